@@ -18,12 +18,42 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE		/* fopencookie() */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
 #include <unistd.h>
 #include <iconv.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef	__linux__
+#include <sys/inotify.h>
+#endif
+#ifdef	__SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef	__AVX2__
+#include <immintrin.h>
+#endif
+#ifdef	HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef	HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 struct	ScRate	{
 	char	*id;
@@ -39,9 +69,14 @@ struct	ScRate	{
 
 
 
-static	char	bom_overflow[8];		/* [0]: number [1]: contents */
+#define UTF_SAMPLE	4096
+
+/* bytes read ahead by BOM detection and charset sampling */
+static	char	utf_sample[UTF_SAMPLE + 8];
+static	int	utf_smp_len, utf_smp_idx;
 static	char	bom_user_defined[64];
 static	int	utf_index = -1;
+static	int	utf_auto = 0;		/* 1: guess the BOM-less encoding */
 static	iconv_t	utf_iconv = (iconv_t) -1;
 
 static	struct	CodePG	{
@@ -64,25 +99,130 @@ static	struct	CodePG	{
 };
 #define BOMLEN	(sizeof(bom_codepage)/sizeof(struct CodePG) - 1)
 
+/* compressed streams are wrapped into FILE so they are transparent to
+ * the utf_readline() and fputs() */
+#define ZIO_NONE	0
+#define ZIO_GZIP	1
+#define ZIO_ZSTD	2
+#define ZIO_BUFSIZE	65536
+
+struct	ZioCookie	{
+	FILE	*fp;		/* the underlying compressed stream */
+	int	codec;
+	int	writing;
+	int	eof;
+	unsigned char	*buf;	/* compressed data */
+	size_t	pos, len;
+#ifdef	HAVE_ZLIB
+	z_stream	zs;
+#endif
+#ifdef	HAVE_ZSTD
+	ZSTD_DStream	*zd;
+	ZSTD_CStream	*zc;
+#endif
+};
+
+/* The cues collected by retiming() for exporting to other formats.
+ * They are decoded and tweaked already so every exported format only
+ * costs the serialization */
+static	struct	SubCue	{
+	time_t	tm_in;
+	time_t	tm_out;
+	char	*layer;		/* ASS/SSA only: " 0", " Marked=0" */
+	char	*extra;		/* ASS/SSA only: ",Style,Name,0,0,0,Effect," */
+	char	*text;		/* SRT lines are joined by '\n' */
+} *cue_list;
+static	int	cue_num, cue_max;
+static	int	cue_pending = 0;	/* 1: collecting SRT text lines */
+static	char	*cue_header;		/* ASS/SSA header before 1st cue */
+static	int	cue_hdlen;
+static	int	cue_enable = 0;		/* 1: collecting for exporting or indexing */
+
+/* the interval index of cues sorted by the start time. The sidecar file
+ * is the header followed by the arrays, in the native byte order */
+#define INDEX_MAGIC	"SUBSIDX1"
+
+struct	IxHeader	{
+	char	magic[8];
+	uint32_t	num;
+	int32_t	level;		/* the level of the root node */
+	uint64_t	blob;		/* size of the text blob */
+};
+
+struct	CueIndex	{
+	int64_t	*start;
+	int64_t	*end;
+	int64_t	*max;		/* the max end time of the subtree */
+	uint32_t	*sn;		/* the order in the subtitle file */
+	uint32_t	*text;		/* offsets of the text in the blob */
+	char	*blob;
+	uint32_t	num;
+	int	level;
+	int	tweak;		/* tweak the time stamps at query time */
+	char	*base;
+	size_t	size;
+	size_t	mapped;		/* 0: allocated */
+};
+
+static	char	*cue_ass_header = "\
+[Script Info]\n\
+ScriptType: v4.00+\n\
+\n\
+[V4+ Styles]\n\
+Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, \
+OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, \
+ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, \
+MarginL, MarginR, MarginV, Encoding\n\
+Style: Default,Arial,20,&H00FFFFFF,&H000000FF,&H00000000,&H00000000,\
+0,0,0,0,100,100,0,0,1,2,2,2,10,10,10,1\n\
+\n\
+[Events]\n\
+Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, \
+Effect, Text\n";
+
 
 char	*subsync_help = "\
 usage: subsync [OPTION] [sutitle_file]\n\
 OPTION:\n\
   -c, --chop N:M         chop the specified number of subtitles (from 1)\n\
-  -e, --encoding ENCODE  default encoding (iconv name)\n\
+  -e, --encoding ENCODE  default encoding (iconv name), or 'auto' to\n\
+                         detect the encoding of files without BOM\n\
+      --engine NAME      the engine of retiming: 'line' (default),\n\
+                         'block' (SIMD scanned blocks), 'chunk' or\n\
+                         'pipe' (pipelined read, transform and write)\n\
+      --fit FILE [MS]    fit the offset and the scale from the anchors of\n\
+                         'EXPECTED ACTUAL' lines in FILE, robust to the\n\
+                         outliers beyond MS milliseconds (default 100)\n\
+      --index FILE       save the interval index of cues to the sidecar FILE\n\
+  -j, --jobs [NUM]       retime a huge file by chunks in NUM threads\n\
+  -m, --manifest FILE    record the processed files in the manifest so\n\
+                         they won't be retimed again (overwrite mode)\n\
   -o                     overwrite the original file (no backup file)\n\
       --overwrite        overwrite the original file (has backup file)\n\
+      --query T [T2]     print the cues active at T, or showing in [T,T2],\n\
+                         from a subtitle or an index file. '-' for the\n\
+                         batch queries of 'T [T2]' lines from stdin\n\
   -r, --reorder [NUM]    reorder the serial number (SRT only)\n\
+      --rules FILE       the transform specs by the patterns of file names\n\
+                         in watch mode, one 'PATTERN [SPEC]' per line\n\
   -s, --span TIME [TIME] specifies the span of the time stamps for processing\n\
+      --snap FILE [MS]   snap the retimed time stamps to the nearest keyframe\n\
+                         in FILE within MS milliseconds (default 100)\n\
   -w, --write FILENAME   write to the specified file\n\
+      --watch DIR OUTDIR watch DIR and retime the files landed in it to\n\
+                         OUTDIR by NUM workers of -j\n\
+  -x, --export FILE      also export to FILE by format of its extension\n\
+                         (srt, ass, ssa, vtt), or by FORMAT only, which\n\
+                         is exported next to the input file\n\
       -/+OFFSET          specifies the offset of the time stamps\n\
       -SCALE             specifies the scale ratio of the time stamps\n\
       --help, --version\n\
       --help-example\n\
 TIME:\n\
-  Two time stamp formats are recognizable:\n\
+  Three time stamp formats are recognizable:\n\
   SRT format HH:MM:SS,mmm, for example, 0:0:10,199\n\
   ASS format HH:MM:SS.mm, for example, 1:0:12.66\n\
+  VTT format HH:MM:SS.mmm, for example, 1:0:12.660\n\
   Note that all 4 time sections are required. Can be filled 0 like 0:0:12,000\n\
 OFFSET:\n\
   Time stamp offset; the prefix '+' or '-' defines delay or bring forward.\n\
@@ -106,6 +246,8 @@ Debug Options:\n\
       --help-strtoms    test reading the time stamps\n\
       --help-debug      display the internal arguments\n\
       --help-example    display the example\n\
+      --help-bench      compare the engines on the synthetic samples and\n\
+                        the following files in every encoding\n\
 ";
 
 char	*subsync_help_example = "\
@@ -128,6 +270,15 @@ Examples:\n\
     subsync -s 0:01:15.00 -00:01:38,880-0:03:02.50 source.ass > target.ass\n\
   Batch shifting the subtitles and overwrite the original files:\n\
     subsync -00:00:01,710-00:01:25,510 -o *.srt\n\
+  Shifting the subtitles and export to SRT, ASS and WebVTT in one pass:\n\
+    subsync +12000 -x ass -x vtt -w target.srt source.srt\n\
+  Fitting the offset and the scale from many anchors and retiming by it:\n\
+    subsync --fit anchors.txt source.ass > target.ass\n\
+  Indexing the cues and query the cues active at 1 hour 2 minutes:\n\
+    subsync --index source.idx source.srt\n\
+    subsync --query 1:02:00,000 source.idx\n\
+  Retiming the files dropped in a folder by 4 workers:\n\
+    subsync +12000 --rules drop.rules -j 4 --watch /srv/drop /srv/retimed\n\
 ";
 
 char	*subsync_version = "Subsync 0.12.0 \
@@ -142,24 +293,182 @@ time_t	tm_range[2] = { -1, -1 };
 int	tm_chop[2] = { -1, -1 };
 int	tm_srtsn = -1;		/* -1: not to orderize SRT sn  */
 int	tm_overwrite = 0;	/* 1: overwrite  2: overwrite and backup */
+char	*tm_export[8];		/* exporting file names or formats */
+int	tm_exnum = 0;
+char	*tm_manifest = NULL;	/* the manifest of processed files */
+char	*tm_fit = NULL;		/* the anchors file for fitting */
+time_t	tm_fittol = 100;	/* the tolerance of inliers in ms */
+char	*tm_snap = NULL;		/* the list of keyframes for snapping */
+time_t	tm_snaptol = 100;	/* the tolerance of snapping in ms */
+char	*tm_index = NULL;	/* the sidecar file of the cue index */
+char	*tm_query[2];		/* the time, or the span of time to query */
+int	tm_jobs = 1;		/* threads for retiming a file by chunks */
+char	*tm_watch[2];		/* the watched and the output directory */
+char	*tm_rules = NULL;	/* the rules file of the transform specs */
+int	tm_engine = 0;		/* the engine of retiming: RT_LINE, ... */
+static	int	rt_engine;	/* the engine which retimed the last file */
+
+#define RT_LINE		0	/* line by line through utf_readline() */
+#define RT_BLOCK	1	/* blocks indexed by the SIMD scanner */
+#define RT_CHUNK	2	/* chunks in parallel threads */
+#define RT_PIPE		3	/* pipelined stages in threads */
+
+/* the manifest records the hashes of the input and the output files */
+static	struct	MfRecord	{
+	uint64_t	in;
+	uint64_t	out;		/* 0: being processed */
+	pid_t		pid;
+	char		*spec;
+	char		*name;
+} *mani_list;
+static	int	mani_num, mani_max;
+static	long	mani_offset;
+static	FILE	*mani_fp;
+static	uint64_t	mani_hash;	/* hash of the current input file */
+static	int	mani_claimed;		/* the current file is claimed */
+
+/* the anchors of (expected, actual) time stamps for fitting */
+struct	FitAnchor	{
+	double	x;		/* the actual time stamp */
+	double	y;		/* the expected time stamp */
+	double	w;		/* the weight of IRLS */
+	int	line;
+};
+
+/* the results of an engine on a sample for the differential benchmark */
+#define BENCH_CUES	200000	/* over 3 CHUNK_SIZE of samples */
+#define BENCH_RUNS	3
+
+struct	BenchRun	{
+	double	mbps;		/* the best throughput of the runs */
+	long	maxrss;		/* peak RSS of the child in KB */
+	long long	syscr;	/* read and write syscalls, -1 if unknown */
+	long long	syscw;
+	uint64_t	hash;	/* XXH64 of the output */
+	long	size;
+	int	engine;		/* the engine actually retimed, or fell back to */
+	int	failed;
+};
+
+/* the sorted keyframes or scene changes for snapping the time stamps */
+static	int64_t	*snap_list;
+static	size_t	snap_num;
+static	size_t	snap_mapped;		/* 0: allocated */
+static	__thread long	snap_cursor;	/* where the last search ended */
+
+
+/* the states of retiming which cross the lines */
+struct	RtState	{
+	int	magic;		/* -1: uncertain 0: SRT 1: SSA */
+	int	subidx;		/* index of subtitles for chopping */
+	int	srtsn;		/* the SRT serial number for reordering */
+};
+
+/* the input in memory for retiming by chunks */
+struct	RtData	{
+	char	*base;
+	size_t	mapped;		/* 0: not mapped but allocated */
+	char	*data;
+	size_t	size;
+};
+
+struct	RtChunk	{
+	char	*start;
+	char	*end;
+	struct	RtState	rs;	/* the states at the beginning of the chunk */
+	int	subidx;		/* subtitles counted in the chunk */
+	int	srtsn;		/* serial numbers counted in the chunk */
+	char	*obuf;
+	size_t	olen;
+	int	failed;		/* the output was lost */
+};
+
+struct	RtPool	{
+	struct	RtChunk	*chunk;
+	int	next;
+	int	last;
+	int	counting;
+};
+
+#define CHUNK_SIZE	(4 << 20)
+#define UTF_LINE	4088	/* the longest line of fgets() in utf_readline() */
+#define SCAN_BLOCK	(1 << 18)	/* the window of the SIMD scanner */
+#define SCAN_CAND	0x80000000U	/* the line goes to the scalar parser */
+#define BLOCK_SIZE	(1 << 20)	/* the reading block of RT_BLOCK */
+#define PIPE_RING	8		/* slots of the ring, power of 2 */
+#define PIPE_BATCH	(64 << 10)	/* the batch of lines between stages */
+
+/* the lock-free ring of single producer and single consumer */
+struct	PipeRing	{
+	void		*slot[PIPE_RING];
+	unsigned	head;		/* only written by the producer */
+	char		pad[60];	/* keep the indexes in two cache lines */
+	unsigned	tail;		/* only written by the consumer */
+};
+
+struct	PipeBatch	{
+	char	buf[PIPE_BATCH];	/* the lines ended by zeros */
+	int	lines;
+	char	*obuf;		/* the output of the lines */
+	size_t	olen;
+	int	failed;		/* the output was lost */
+};
 
+struct	PipeLine	{
+	struct	PipeRing	todo;	/* reader -> transform */
+	struct	PipeRing	done;	/* transform -> writer */
+	struct	PipeRing	idle;	/* writer -> reader */
+	struct	PipeBatch	*batch;
+	FILE	*fout;
+	int	failed;		/* set by the writer */
+};
 
 static int retiming(FILE *fin, FILE *fout);
+static int retime_line(char *buf, FILE *fout, struct RtState *rs);
+static int chunk_retiming(FILE *fin, FILE *fout);
+static int block_retiming(FILE *fin, FILE *fout);
+static int pipe_retiming(FILE *fin, FILE *fout);
+static void chunk_unload(struct RtData *rd);
 static int utf_open(FILE *fin, FILE *fout, int cp);
 static int utf_readline(FILE *fin, char *buf, int len);
+static int utf_read_unit(char *s, int width, FILE *fin);
 static int utf_lr(char *s);
 static int utf_bom_detect(FILE *fin);
+static int utf_guess(FILE *fin);
 static int utf_bom_user_defined(char *s);
+static FILE *zio_input(FILE *fin, int *codec);
+static FILE *zio_output(FILE *fout, int codec);
+static int zio_codec(char *fname);
+static int zio_support(int codec, char *fname);
+static int manifest_open(char *fname);
+static int manifest_claim(char *fname);
+static int manifest_commit(char *fname);
+static int manifest_release(char *fname);
+static int watch_dir(char *idir, char *odir);
 static time_t tweaktime(time_t ms);
-static int chop_filter(char *s, int *magic);
+static time_t tweakend(time_t ms, time_t ms_in, time_t tm_in);
+static int snap_load(char *fname);
+static time_t snap_time(time_t ms);
+static int chop_filter(char *s, struct RtState *rs);
+static int cue_collect(time_t tm_in, time_t tm_out, char *layer, char *s);
+static int cue_text(char *s);
+static int cue_export(char *iname);
+static void cue_free(void);
+static int index_main(char *fname, FILE *fout);
+static void index_free(struct CueIndex *ix);
 static time_t strtoms(char *s, int *len, int *style);
 static char *mstostr(time_t ms, int style);
 static double arg_scale(char *s);
 static time_t arg_offset(char *s);
 static int is_number(char *s);
+static int fit_anchors(char *fname, time_t tol);
 static int mocker(FILE *fin, char *argv);
 static int help_tools(int argc, char **argv);
 static void test_str_to_ms(void);
+static int bench_main(int argc, char **argv);
+static int bench_sample(char *fname, int ass);
+static int bench_encode(char *src, char *dst, int idx);
+static int bench_run(char *src, char *dst, int engine, struct BenchRun *br);
 
 #define MOREARG(c,v)	{	\
 	--(c), ++(v); \
@@ -174,6 +483,7 @@ int main(int argc, char **argv)
 {
 	FILE	*fin = NULL, *fout = NULL;
 	char	*oname, mock_option[32] = "";
+	int	codec, rc = 0;
 
 	while (--argc && ((**++argv == '-') || (**argv == '+'))) {
 		if (!strcmp(*argv, "-V") || !strcmp(*argv, "--version")) {
@@ -190,6 +500,30 @@ int main(int argc, char **argv)
 			tm_overwrite = 1;	/* no backup */
 		} else if (!strcmp(*argv, "--overwrite")) {
 			tm_overwrite = 2;	/* has backup */
+		} else if (!strcmp(*argv, "-j") || !strcmp(*argv, "--jobs")) {
+			if ((argc > 1) && is_number(argv[1])) {
+				--argc;	tm_jobs = (int)strtol(*++argv, NULL, 0);
+			} else {
+				tm_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+			}
+			tm_engine = RT_CHUNK;
+		} else if (!strcmp(*argv, "--engine")) {
+			MOREARG(argc, argv);
+			if (!strcmp(*argv, "line")) {
+				tm_engine = RT_LINE;
+			} else if (!strcmp(*argv, "block")) {
+				tm_engine = RT_BLOCK;
+			} else if (!strcmp(*argv, "chunk")) {
+				tm_engine = RT_CHUNK;
+			} else if (!strcmp(*argv, "pipe")) {
+				tm_engine = RT_PIPE;
+			} else {
+				fprintf(stderr, "%s: unknown engine\n", *argv);
+				return -1;
+			}
+		} else if (!strcmp(*argv, "-m") || !strcmp(*argv, "--manifest")) {
+			MOREARG(argc, argv);
+			tm_manifest = *argv;
 		} else if (!strcmp(*argv, "-c") || !strcmp(*argv, "--chop")) {
 			MOREARG(argc, argv);
 			if (sscanf(*argv, "%d : %d", tm_chop, tm_chop + 1) != 2) {
@@ -197,9 +531,13 @@ int main(int argc, char **argv)
 			}
 		} else if (!strcmp(*argv, "-e") || !strcmp(*argv, "--encoding")) {
 			MOREARG(argc, argv);
-			utf_index = utf_bom_user_defined(*argv);
+			if (!strcasecmp(*argv, "auto")) {
+				utf_auto = 1;
+			} else {
+				utf_index = utf_bom_user_defined(*argv);
+			}
 		} else if (!strcmp(*argv, "-r") || !strcmp(*argv, "--reorder")) {
-			if ((argc > 0) && is_number(argv[1])) {
+			if ((argc > 1) && is_number(argv[1])) {
 				--argc;	tm_srtsn = (int)strtol(*++argv, NULL, 0);
 			} else {
 				tm_srtsn = 1;	/* set as default */
@@ -208,14 +546,60 @@ int main(int argc, char **argv)
 			MOREARG(argc, argv);
 			tm_range[0] = arg_offset(*argv);
 			/* the second parameter is optional, must begin in number */
-			if ((argc > 0) && isdigit(argv[1][0])) {
+			if ((argc > 1) && isdigit(argv[1][0])) {
 				--argc; tm_range[1] = arg_offset(*++argv);
 			}
 		} else if (!strcmp(*argv, "-w") || !strcmp(*argv, "--write")) {
 			MOREARG(argc, argv);
+			if ((codec = zio_codec(*argv)) < 0) {
+				return -1;
+			}
 			if ((fout = fopen(*argv, "w")) == NULL) {
 				perror(*argv);
 			}
+			fout = zio_output(fout, codec);
+		} else if (!strcmp(*argv, "--index")) {
+			MOREARG(argc, argv);
+			tm_index = *argv;
+		} else if (!strcmp(*argv, "--query")) {
+			if (argc < 2) {
+				fprintf(stderr, "missing parameters\n");
+				return -1;
+			}
+			--argc; tm_query[0] = *++argv;
+			/* the second time is optional */
+			if ((argc > 1) && (arg_offset(argv[1]) != -1)) {
+				--argc; tm_query[1] = *++argv;
+			}
+		} else if (!strcmp(*argv, "--fit")) {
+			MOREARG(argc, argv);
+			tm_fit = *argv;
+			/* the tolerance is optional, must be a number */
+			if ((argc > 1) && is_number(argv[1])) {
+				--argc; tm_fittol = strtol(*++argv, NULL, 0);
+			}
+		} else if (!strcmp(*argv, "--snap")) {
+			MOREARG(argc, argv);
+			tm_snap = *argv;
+			/* the tolerance is optional, must be a number */
+			if ((argc > 1) && is_number(argv[1])) {
+				--argc; tm_snaptol = strtol(*++argv, NULL, 0);
+			}
+		} else if (!strcmp(*argv, "--watch")) {
+			MOREARG(argc, argv);
+			tm_watch[0] = *argv;
+			MOREARG(argc, argv);
+			tm_watch[1] = *argv;
+		} else if (!strcmp(*argv, "--rules")) {
+			MOREARG(argc, argv);
+			tm_rules = *argv;
+		} else if (!strcmp(*argv, "-x") || !strcmp(*argv, "--export")) {
+			MOREARG(argc, argv);
+			if (tm_exnum < sizeof(tm_export)/sizeof(char*)) {
+				tm_export[tm_exnum++] = *argv;
+			} else {
+				fprintf(stderr, "%s: too many exports.\n", *argv);
+			}
 		} else if (!strcmp(*argv, "--")) {
 			break;
 		} else if (arg_offset(*argv) != -1) {
@@ -227,23 +611,79 @@ int main(int argc, char **argv)
 			return -1;
 		}
 	}
+	/* the fitted transform replaces the offset and the scale */
+	if (tm_fit && (fit_anchors(tm_fit, tm_fittol) < 0)) {
+		return -1;
+	}
 	if ((tm_offset == 0) && (tm_scale == 0) && (tm_srtsn < 0) && 
-			(tm_chop[0] < 0) && (tm_chop[1] < 0)) {
+			(tm_chop[0] < 0) && (tm_chop[1] < 0) && !tm_exnum &&
+			!tm_rules && !tm_index && !tm_query[0] && !tm_snap &&
+			!tm_fit) {
 		puts(subsync_help);
 		return 0;
 	}
+	cue_enable = (tm_exnum > 0);
+	if (tm_snap && (snap_load(tm_snap) < 0)) {
+		return -1;
+	}
+
+	/* build the index of cues, and/or query it */
+	if (tm_index || tm_query[0]) {
+		if ((argc == 0) || !strcmp(*argv, "--")) {
+			oname = NULL;	/* from stdin */
+		} else {
+			oname = *argv;
+		}
+		if (!strcmp(tm_query[0] ? tm_query[0] : "", "-") && !oname) {
+			fprintf(stderr, "batch queries need the input file.\n");
+			return -1;
+		}
+		codec = index_main(oname, fout ? fout : stdout);
+		if (fout != NULL) {
+			fclose(fout);
+		}
+		return codec;
+	}
+
+	/* retime the files landing in the watched directory */
+	if (tm_watch[0]) {
+		if (fout != NULL) {
+			fclose(fout);
+		}
+		return watch_dir(tm_watch[0], tm_watch[1]);
+	}
 
 	/* input from stdin */
 	if ((argc == 0) || !strcmp(*argv, "--")) {
+		if ((fin = zio_input(stdin, NULL)) == NULL) {
+			if (fout != NULL) {
+				fclose(fout);
+			}
+			return -1;
+		}
 		if (mock_option[0]) {
-			mocker(stdin, mock_option);
+			mocker(fin, mock_option);
 		} else if (fout == NULL) {
-			retiming(stdin, stdout);
+			rc = retiming(fin, stdout);
+			cue_export(NULL);
 		} else {
-			retiming(stdin, fout);
+			rc = retiming(fin, fout);
+			cue_export(NULL);
 			fclose(fout);
 		}
-		return 0;
+		if (fin != stdin) {
+			fclose(fin);
+		}
+		return rc;
+	}
+
+	if (tm_manifest) {
+		if (!tm_overwrite) {
+			fprintf(stderr, "%s: manifest works in overwrite mode.\n",
+					tm_manifest);
+		} else if (manifest_open(tm_manifest) < 0) {
+			return -1;
+		}
 	}
 
 	/* don't overwrite but still batch processing 
@@ -257,17 +697,22 @@ int main(int argc, char **argv)
 				perror(*argv);
 				continue;
 			}
+			if ((fin = zio_input(fin, NULL)) == NULL) {
+				continue;
+			}
 			if (mock_option[0]) {
 	                        mocker(fin, mock_option);
+			} else if (retiming(fin, fout) < 0) {
+				rc = -1;
 			} else {
-				retiming(fin, fout);
+				cue_export(*argv);
 			}
 			fclose(fin);
 		}
 		if (fout != stdout) {
 			fclose(fout);
 		}
-		return 0;
+		return rc;
 	}
 
 	/* the overwrite option override the write option */
@@ -278,12 +723,28 @@ int main(int argc, char **argv)
 	/* 20180912 Using Unix trick to preserve the backup file
 	 * Hope it's portable to Windows */
 	for ( ; argc; argc--, argv++) {
+		if (mani_fp && manifest_claim(*argv)) {
+			continue;	/* retimed already */
+		}
+		/* the claim must be released if the file failed */
 		if ((fin = fopen(*argv, "r")) == NULL) {
 			perror(*argv);
+			manifest_release(*argv);
+			continue;
+		}
+		/* keep the compression of the original file */
+		if ((fin = zio_input(fin, &codec)) == NULL) {
+			manifest_release(*argv);
+			continue;
+		}
+		if ((codec == ZIO_NONE) && ((codec = zio_codec(*argv)) < 0)) {
+			fclose(fin);
+			manifest_release(*argv);
 			continue;
 		}
 		if ((oname = malloc(strlen(*argv)+16)) == NULL) {
 			fclose(fin);
+			manifest_release(*argv);
 			continue;
 		}
 		strcpy(oname, *argv);
@@ -299,12 +760,23 @@ int main(int argc, char **argv)
 			perror(*argv);
 			free(oname);
 			fclose(fin);
+			manifest_release(*argv);
 			continue;
 		}
+		fout = zio_output(fout, codec);
 		if (mock_option[0]) {
                         mocker(fin, mock_option);
+		} else if (retiming(fin, fout) < 0) {
+			/* restore the original file from the backup */
+			fclose(fout);
+			fclose(fin);
+			rename(oname, *argv);
+			free(oname);
+			manifest_release(*argv);
+			rc = -1;
+			continue;
 		} else {
-			retiming(fin, fout);
+			cue_export(*argv);
 		}
 		fclose(fout);
 		fclose(fin);
@@ -313,321 +785,2825 @@ int main(int argc, char **argv)
 			unlink(oname);
 		}
 		free(oname);
+		if (mani_fp) {
+			manifest_commit(*argv);
+		}
 	}
-	return 0;
+	return rc;
 }
 
 static int retiming(FILE *fin, FILE *fout)
 {
-	char	buf[4096], *s = 0;
-	time_t	ms;
-	int	n, style, srtsn;
-	int	magic = -1;		/* -1: uncertain 0: SRT 1: SSA */
+	struct	RtState	rs = { -1, 0, tm_srtsn };
+	char	buf[4096];
+	int	n = 0, rc = -1;
 
 	utf_open(fin, fout, 0);
 
-	srtsn = tm_srtsn;
-	while (utf_readline(fin, buf, sizeof(buf)-1) > 0) {
-		if (chop_filter(buf, &magic)) {
-			continue;	/* skip the specified subtitles */
-		}
-
-		/* skip and output the whitespaces */
-		for (s = buf; (*s > 0) && (*s <= 0x20); s++) fputc(*s, fout);
-		
-		/* SRT: 00:02:17,440 --> 00:02:20,375
-		 * ASS: Dialogue: Marked=0,0:02:42.42,0:02:44.15,Wolf main,
-		 *           autre,0000,0000,0000,,Toujours rien. */
-		if (!strncmp(s, "Dialogue:", 9)) {	/* ASS/SSA timestamp */
-			/* output everything before the first timestamp */
-			while (*s != ',') fputc(*s++, fout);
-			/* output the ',' also */
-			fputc(*s++, fout);
-			/* read and skip the first timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			fputs(mstostr(tweaktime(ms), style), fout);
-			/* output everything before the second timestamp */
-			while (*s != ',') fputc(*s++, fout);
-			/* output the ',' also */
-			fputc(*s++, fout);
-			/* read and skip the second timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			fputs(mstostr(tweaktime(ms), style), fout);
-		} else if ((ms = strtoms(s, &n, &style)) != -1) {	/* SRT timestamp */
-			/* skip the first timestamp */
-			s += n;
-			/* output the tweaked timestamp */
-			fputs(mstostr(tweaktime(ms), style), fout);
-
-			/* output everything before the second timestamp */
-			while (!isdigit(*s)) fputc(*s++, fout);
-			/* read and skip the second timestamp */
-			ms = strtoms(s, &n, &style);
-			s += n;
-			/* output the tweaked timestamp */
-			fputs(mstostr(tweaktime(ms), style), fout);
-		} else if ((srtsn > 0) && is_number(s)) {
-			/* SRT serial numbers to be re-ordered */
-			fprintf(fout, "%d", srtsn++);
-			while (isdigit(*s)) s++;
-		} 
-		/* output rest of things */
-		fputs(s, fout);
+	/* the pipeline takes any encoding and the exporting, while the
+	 * blocks must be in single byte and need no conversion.
+	 * The engines return <0 before reading anything so the lines can
+	 * take over, or >0 if the output was lost halfway */
+	rt_engine = RT_LINE;
+	if (tm_engine == RT_PIPE) {
+		rc = pipe_retiming(fin, fout);
+		rt_engine = (rc < 0) ? RT_LINE : RT_PIPE;
+	} else if (tm_engine && !cue_enable && (utf_iconv == (iconv_t) -1) &&
+			((utf_index < 0) || (bom_codepage[utf_index].width == 1))) {
+		if ((tm_engine == RT_CHUNK) && (tm_jobs > 1)) {
+			rc = chunk_retiming(fin, fout);
+			rt_engine = (rc < 0) ? RT_LINE : RT_CHUNK;
+		} else {
+			rc = block_retiming(fin, fout);
+			rt_engine = (rc < 0) ? RT_LINE : RT_BLOCK;
+		}
+	}
+	while ((rc < 0) && utf_readline(fin, buf, sizeof(buf)-1) > 0) {
+		retime_line(buf, fout, &rs);
+		n++;
 	}
 
 	/* make sure to output everything before closing the output */
-	if (s) {
+	if (n) {
 		fflush(fout);
 	}
 
-	if (utf_iconv >= 0) {
+	if (utf_iconv != (iconv_t) -1) {
 		iconv_close(utf_iconv);
+		utf_iconv = (iconv_t) -1;
+	}
+	if (rc > 0) {
+		fprintf(stderr, "retiming failed: the output is incomplete.\n");
+		return -1;
 	}
 	return 0;
 }
 
-static int utf_open(FILE *fin, FILE *fout, int cp)
+/* load the rest of the input into memory for chunking. Regular files are 
+ * mapped, while pipes and compressed streams are read into the buffer */
+static int chunk_load(FILE *fin, struct RtData *rd)
 {
-	int	n;
+	struct	stat	st;
+	size_t	n, left = utf_smp_len - utf_smp_idx;
+	long	off;
+	char	*p;
 
-	if ((n = utf_bom_detect(fin)) >= 0) {
-		utf_index = n;
+	memset(rd, 0, sizeof(struct RtData));
+	if ((fileno(fin) >= 0) && !fstat(fileno(fin), &st) && 
+			S_ISREG(st.st_mode) && (st.st_size > 0) &&
+			((off = ftell(fin)) >= (long) left)) {
+		rd->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				fileno(fin), 0);
+		if (rd->base != MAP_FAILED) {
+			rd->mapped = st.st_size;
+			rd->data = rd->base + off - left;
+			rd->size = st.st_size - off + left;
+			utf_smp_idx = utf_smp_len;	/* consumed */
+			fseek(fin, 0, SEEK_END);
+			return 0;
+		}
 	}
-	if (utf_index < 0) {
-		/* no codepage specified: default IO */
-		return utf_index;
+
+	n = CHUNK_SIZE;
+	if ((rd->base = malloc(n)) == NULL) {
+		return -1;
 	}
-	if (utf_index != cp) {
-		/* different input/output codepage: need iconv */
-		utf_iconv = iconv_open(bom_codepage[cp].iconv_name,
-				bom_codepage[utf_index].iconv_name);
-		if (utf_iconv == (iconv_t) -1) {
-			return utf_index;
+	memcpy(rd->base, utf_sample + utf_smp_idx, left);
+	utf_smp_idx = utf_smp_len;
+	rd->size = left;
+	while ((left = fread(rd->base + rd->size, 1, n - rd->size, fin)) > 0) {
+		if ((rd->size += left) == n) {
+			if ((p = realloc(rd->base, n * 2)) == NULL) {
+				free(rd->base);
+				return -1;
+			}
+			rd->base = p;
+			n *= 2;
 		}
 	}
+	rd->data = rd->base;
+	return 0;
+}
 
-	/* same input/output codepage or successful iconv, 
-	 * probably need to write a BOM explicity 
-	 * except UTF-8 and User defined codepage */
-	if ((cp > 0) && (cp < BOMLEN)) {
-		fwrite(bom_codepage[cp].magic, 1, 
-				bom_codepage[cp].magic_len, fout);
+/* find the next cue boundary from 'p': after a blank line for SRT, or
+ * before the "Dialogue:" for ASS/SSA. Otherwise the next line */
+static char *chunk_boundary(char *p, char *end)
+{
+	char	*first = NULL, *s;
+	int	limit = 65536;
+
+	while ((p < end) && (limit > 0)) {
+		if ((s = memchr(p, '\n', end - p)) == NULL) {
+			return end;
+		}
+		limit -= ++s - p;
+		if (first == NULL) {
+			first = s;
+		}
+		if ((end - s >= 9) && !memcmp(s, "Dialogue:", 9)) {
+			return s;
+		}
+		p = s;
+		if ((p < end) && (*p == '\r')) {
+			p++;
+		}
+		if ((p < end) && (*p == '\n')) {
+			return p + 1;	/* blank line */
+		}
 	}
-	return utf_index;
+	return first ? first : end;
 }
 
-static int utf_readline(FILE *fin, char *buf, int len)
+/* the masks of '\n' and zero bytes in a 64-byte stride */
+static uint64_t scan_mask(const char *s, uint64_t *zero)
 {
-	size_t	in_bytes_left, out_bytes_left;
-	char	rbuf[4090], *in_buf;
+#if	defined(__AVX2__)
+	__m256i	nl = _mm256_set1_epi8('\n'), nil = _mm256_setzero_si256();
+	__m256i	a = _mm256_loadu_si256((const __m256i *) s);
+	__m256i	b = _mm256_loadu_si256((const __m256i *) (s + 32));
+
+	*zero = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nil)) |
+		((uint64_t)(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nil)) << 32);
+	return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+		((uint64_t)(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32);
+#elif	defined(__SSE2__)
+	__m128i	nl = _mm_set1_epi8('\n'), nil = _mm_setzero_si128(), v;
+	uint64_t	m = 0;
 	int	i;
 
-	if ((utf_index < 0) || (bom_codepage[utf_index].width == 1)) {
-		if (bom_overflow[0]) {
-			i = bom_overflow[0];
-			bom_overflow[0] = 0;	/* free the overflow buffer */
-			/* 0xa would stop BOM searching anyway so it must be
-			 * the last item in the BOM overflow buffer */
-			if (bom_overflow[i] == 0xa) {
-				memcpy(buf, &bom_overflow[1], i);
-				buf[i] = 0;
-				return i;
-			}
-			memcpy(rbuf, &bom_overflow[1], i);
-			rbuf[i] = 0;
-			fgets(&rbuf[i], sizeof(rbuf)-i-1, fin);
-		} else if (fgets(rbuf, sizeof(rbuf)-1, fin) == NULL) {
+	*zero = 0;
+	for (i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		m |= (uint64_t)(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) & 0xffff) << i;
+		*zero |= (uint64_t)(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nil)) & 0xffff) << i;
+	}
+	return m;
+#else
+	uint64_t	m = 0;
+	int	i;
+
+	*zero = 0;
+	for (i = 0; i < 64; i++) {
+		m |= (uint64_t)(s[i] == '\n') << i;
+		*zero |= (uint64_t)(s[i] == 0) << i;
+	}
+	return m;
+#endif
+}
+
+/* whether the line could be changed by retime_line(): a time stamp starts
+ * by a digit or a sign, or else a "Dialogue:"; the SRT serial numbers are 
+ * digits too. Other lines go to the output as they are */
+static int scan_candidate(const char *s, const char *end)
+{
+	for ( ; (s < end) && (*s > 0) && (*s <= 0x20); s++);
+	if (s >= end) {
+		return 0;
+	}
+	if (isdigit(*s) || (*s == '+') || (*s == '-')) {
+		return 1;
+	}
+	return (*s == 'D') && (end - s >= 9) && !memcmp(s, "Dialogue:", 9);
+}
+
+/* index the complete lines in the block by the strides of SIMD compares.
+ * The index keeps the offsets of the line starts, flagged by SCAN_CAND 
+ * when the line has to go to the scalar parser: a candidate of time stamps,
+ * a line with zero bytes or a line longer than fgets() could read.
+ * Returns the number of lines and 'tail' is the offset after the last '\n' */
+static int scan_block(const char *s, int len, uint32_t *idx, int *tail)
+{
+	char	pad[64];
+	uint64_t	nl, zero, low;
+	int	i, n, bit, start, zseen;
+
+	for (i = n = start = zseen = 0; i < len; i += 64) {
+		if (len - i >= 64) {
+			nl = scan_mask(s + i, &zero);
+		} else {
+			memset(pad, ' ', sizeof(pad));
+			memcpy(pad, s + i, len - i);
+			nl = scan_mask(pad, &zero);
+		}
+		while (nl) {
+			bit = __builtin_ctzll(nl);
+			low = (bit == 63) ? ~0ULL : (2ULL << bit) - 1;
+			idx[n] = start;
+			if (zseen || (zero & low) || (i + bit + 1 - start > UTF_LINE) ||
+					scan_candidate(s + start, s + i + bit)) {
+				idx[n] |= SCAN_CAND;
+			}
+			n++;
+			start = i + bit + 1;
+			zero &= ~low;
+			zseen = 0;
+			nl &= nl - 1;
+		}
+		zseen |= (zero != 0);
+	}
+	*tail = start;
+	return n;
+}
+
+/* cut the segment into lines as fgets() does and send them to the 
+ * scalar parser. Returns -1 on the line of zero byte where 
+ * utf_readline() stops too */
+static int scan_scalar(char *p, char *end, FILE *fout, struct RtState *rs)
+{
+	char	line[UTF_LINE + 8], *q, *s;
+	size_t	n;
+
+	for ( ; p < end; p = q) {
+		n = end - p;
+		n = (n > UTF_LINE) ? UTF_LINE : n;
+		if ((q = memchr(p, '\n', n)) != NULL) {
+			q++;
+		} else {
+			q = p + n;
+		}
+		memcpy(line, p, q - p);
+		line[q - p] = 0;
+		if (line[0] == 0) {
 			return -1;
 		}
-		if (utf_iconv == (iconv_t) -1) {
-			strncpy(buf, rbuf, len - 1);
-			return strlen(buf);
+		if (fout) {
+			retime_line(line, fout, rs);
+			continue;
+		}
+		/* counting mode */
+		if (chop_filter(line, rs)) {
+			continue;
+		}
+		for (s = line; (*s > 0) && (*s <= 0x20); s++);
+		if (is_number(s)) {
+			rs->srtsn++;
 		}
-		in_bytes_left  = strlen(rbuf);
-		out_bytes_left = len;
-		in_buf = (char*)rbuf;
-		// https://stackoverflow.com/questions/14148814/c-using-of-iconv-on-windows-with-mingw-compiler
-		// utf_iconv = iconv_open("UTF-8", "WINDOWS-1251");
-		iconv(utf_iconv, &in_buf, &in_bytes_left, &buf, &out_bytes_left);
-		len -= (int)out_bytes_left;
-		*buf = 0;
-		return len;
 	}
+	return 0;
+}
 
-	i = 0;
-	while (fread(&rbuf[i], bom_codepage[utf_index].width, 1, fin)) {
-		if (utf_lr(&rbuf[i])) {
-			i += bom_codepage[utf_index].width;
+/* retime the lines in memory from 'p' to 'end'. Only the candidate lines
+ * go to the scalar parser, while the runs of other lines are written in 
+ * one go. Without 'final', the incomplete line at the end is left for 
+ * the next block. No 'fout' means the counting mode.
+ * Returns where it stopped, or NULL if a zero line stopped the input */
+static char *scan_run(char *p, char *end, int final, FILE *fout, struct RtState *rs)
+{
+	uint32_t	*idx;
+	char	*run, *ls, *le;
+	int	i, n, len, tail, scalar;
+
+	/* chopping must see every line */
+	scalar = (tm_chop[0] >= 0) || (tm_chop[1] >= 0);
+	if ((idx = malloc(SCAN_BLOCK * sizeof(uint32_t))) == NULL) {
+		return p;
+	}
+	while (p < end) {
+		len = (end - p > SCAN_BLOCK) ? SCAN_BLOCK : end - p;
+		if ((n = scan_block(p, len, idx, &tail)) == 0) {
+			if (final && (p + len == end)) {
+				tail = len;	/* the last line without '\n' */
+			} else if (len < SCAN_BLOCK) {
+				break;		/* wait for the next block */
+			} else {
+				tail = len - len % UTF_LINE;	/* a huge line */
+			}
+			if (scan_scalar(p, p + tail, fout, rs) < 0) {
+				p = NULL;
+				break;
+			}
+			p += tail;
+			continue;
+		}
+		for (i = 0, run = p; i < n; i++) {
+			ls = p + (idx[i] & ~SCAN_CAND);
+			if (!scalar && !(idx[i] & SCAN_CAND)) {
+				continue;
+			}
+			if (fout && (ls > run)) {
+				fwrite(run, 1, ls - run, fout);
+			}
+			le = (i + 1 < n) ? p + (idx[i+1] & ~SCAN_CAND) : p + tail;
+			if (scan_scalar(ls, le, fout, rs) < 0) {
+				free(idx);
+				return NULL;
+			}
+			run = le;
+		}
+		if (fout && (p + tail > run)) {
+			fwrite(run, 1, p + tail - run, fout);
+		}
+		p += tail;
+	}
+	free(idx);
+	return p;
+}
+
+/* run the lines in the chunk by the same cutting as fgets() in 
+ * utf_readline(). Counting mode only counts the subtitle indexes and 
+ * the SRT serial numbers without output */
+static void chunk_run(struct RtChunk *ck, int counting)
+{
+	struct	RtState	rs = ck->rs;
+	FILE	*fout = NULL;
+
+	if (!counting && ((fout = open_memstream(&ck->obuf, &ck->olen)) == NULL)) {
+		ck->failed = 1;
+		return;
+	}
+	scan_run(ck->start, ck->end, 1, fout, &rs);
+	if (fout && fclose(fout)) {
+		ck->failed = 1;
+	}
+	ck->subidx = rs.subidx - ck->rs.subidx;
+	ck->srtsn  = rs.srtsn  - ck->rs.srtsn;
+}
+
+static void *chunk_worker(void *arg)
+{
+	struct	RtPool	*pool = arg;
+	int	i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->last) {
+		chunk_run(&pool->chunk[i], pool->counting);
+	}
+	return NULL;
+}
+
+/* run the chunks from 'first' to 'last' by the worker threads */
+static void chunk_pool(struct RtChunk *chunk, int first, int last, int counting)
+{
+	struct	RtPool	pool = { chunk, first, last, counting };
+	pthread_t	tid[256];
+	int	i, n;
+
+	n = (last - first < tm_jobs) ? last - first : tm_jobs;
+	n = (n > 256) ? 256 : n;
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&tid[i], NULL, chunk_worker, &pool)) {
 			break;
 		}
-		i += bom_codepage[utf_index].width;
 	}
-	if (utf_iconv == (iconv_t) -1) {
-		perror("iconv");
-		return 0;
+	chunk_worker(&pool);	/* in case of failing to create threads */
+	while (i--) {
+		pthread_join(tid[i], NULL);
+	}
+}
+
+/* retime a huge file by chunks in parallel. The chunks are split at the cue
+ * boundaries; the SRT serial numbers and the chopping indexes come from 
+ * the prefix sum of the numbers counted in every chunk, so the output is 
+ * identical to the serial retiming. */
+static int chunk_retiming(FILE *fin, FILE *fout)
+{
+	struct	RtData	rd;
+	struct	RtChunk	*chunk;
+	struct	RtState	rs = { -1, 0, 0 };
+	char	line[UTF_LINE + 8], *p, *q, *end, *magic_at = NULL;
+	int	i, n, w, zero, lost = 0;
+
+	if (chunk_load(fin, &rd) < 0) {
+		return -1;
+	}
+	end = rd.data + rd.size;
+	n = rd.size / CHUNK_SIZE + 1;
+	if ((chunk = calloc(n, sizeof(struct RtChunk))) == NULL) {
+		chunk_unload(&rd);
+		return 1;	/* the input was consumed already */
+	}
+
+	/* a zero byte would stop utf_readline() so leave it to one chunk */
+	zero = (memchr(rd.data, 0, rd.size) != NULL);
+	for (i = 0, p = rd.data; p < end; i++) {
+		chunk[i].start = p;
+		q = p + CHUNK_SIZE;
+		if (zero || (q >= end) || (i + 1 == n)) {
+			p = chunk[i].end = end;
+		} else {
+			p = chunk[i].end = chunk_boundary(q, end);
+		}
+	}
+	n = i;
+
+	/* the type of subtitles is decided by the first recognised line */
+	if ((tm_chop[0] > 0) || (tm_chop[1] > 0)) {
+		for (p = rd.data; (p < end) && (rs.magic < 0); p = q) {
+			w = (end - p > UTF_LINE) ? UTF_LINE : end - p;
+			q = memchr(p, '\n', w);
+			q = q ? q + 1 : p + w;
+			memcpy(line, p, q - p);
+			line[q - p] = 0;
+			chop_filter(line, &rs);
+			magic_at = p;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		chunk[i].rs.magic = (magic_at && (chunk[i].start > magic_at)) ?
+			rs.magic : -1;
+	}
+
+	/* prefix sum of the chopping indexes, then the serial numbers which
+	 * rely on whether the lines were chopped */
+	if ((tm_chop[0] > 0) || (tm_chop[1] > 0) || (tm_srtsn > 0)) {
+		chunk_pool(chunk, 0, n, 1);
+		for (i = 1; i < n; i++) {
+			chunk[i].rs.subidx = chunk[i-1].rs.subidx + chunk[i-1].subidx;
+		}
+		if (((tm_chop[0] > 0) || (tm_chop[1] > 0)) && (tm_srtsn > 0)) {
+			chunk_pool(chunk, 0, n, 1);
+		}
+	}
+	chunk[0].rs.srtsn = tm_srtsn;
+	for (i = 1; i < n; i++) {
+		chunk[i].rs.srtsn = chunk[i-1].rs.srtsn;
+		if (tm_srtsn > 0) {
+			chunk[i].rs.srtsn += chunk[i-1].srtsn;
+		}
+	}
+
+	/* retime by windows of chunks so the memory of output is limited.
+	 * The output stops at the first chunk lost */
+	for (w = 0; w < n; w += tm_jobs * 2) {
+		i = (w + tm_jobs * 2 < n) ? w + tm_jobs * 2 : n;
+		if (!lost) {
+			chunk_pool(chunk, w, i, 0);
+		}
+		for (i = w; (i < n) && (i < w + tm_jobs * 2); i++) {
+			lost |= chunk[i].failed;
+			if (chunk[i].obuf && !lost) {
+				fwrite(chunk[i].obuf, 1, chunk[i].olen, fout);
+			}
+			free(chunk[i].obuf);
+		}
+	}
+	fflush(fout);
+	free(chunk);
+	chunk_unload(&rd);
+	return lost;
+}
+
+/* retime by blocks read from the input, files or pipes alike. The SIMD 
+ * scanner indexes the lines in the block so only the candidates of 
+ * time stamps are parsed line by line */
+static int block_retiming(FILE *fin, FILE *fout)
+{
+	struct	RtState	rs = { -1, 0, tm_srtsn };
+	size_t	n, len = utf_smp_len - utf_smp_idx;
+	char	*buf, *p;
+	int	eof;
+
+	if ((buf = malloc(BLOCK_SIZE)) == NULL) {
+		return -1;
+	}
+	memcpy(buf, utf_sample + utf_smp_idx, len);
+	utf_smp_idx = utf_smp_len;	/* consumed */
+	do {
+		n = fread(buf + len, 1, BLOCK_SIZE - len, fin);
+		eof = (n < BLOCK_SIZE - len);
+		len += n;
+		if ((p = scan_run(buf, buf + len, eof, fout, &rs)) == NULL) {
+			break;		/* stopped by a zero line */
+		}
+		len = buf + len - p;
+		memmove(buf, p, len);
+	} while (!eof);
+	fflush(fout);
+	free(buf);
+	return 0;
+}
+
+/* wait for the other stage: spin shortly, then yield, then nap */
+static void pipe_wait(int *spin)
+{
+	if (++*spin < 64) {
+		return;
+	}
+	if (*spin < 256) {
+		sched_yield();
+	} else {
+		usleep(50);
+	}
+}
+
+static void pipe_push(struct PipeRing *r, void *p)
+{
+	unsigned	head = r->head;
+	int	spin = 0;
+
+	while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= PIPE_RING) {
+		pipe_wait(&spin);
+	}
+	r->slot[head % PIPE_RING] = p;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *pipe_pop(struct PipeRing *r)
+{
+	unsigned	tail = r->tail;
+	void	*p;
+	int	spin = 0;
+
+	while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+		pipe_wait(&spin);
+	}
+	p = r->slot[tail % PIPE_RING];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+/* the transform stage: parse and tweak the lines into the output buffer
+ * of the batch. It's the only stage touching the cues for exporting */
+static void *pipe_transform(void *arg)
+{
+	struct	PipeLine	*pl = arg;
+	struct	PipeBatch	*b;
+	struct	RtState	rs = { -1, 0, tm_srtsn };
+	FILE	*fp;
+	char	*s;
+	int	i;
+
+	while ((b = pipe_pop(&pl->todo)) != NULL) {
+		b->obuf = NULL;
+		b->olen = 0;
+		if ((fp = open_memstream(&b->obuf, &b->olen)) == NULL) {
+			b->failed = 1;
+		} else {
+			for (i = 0, s = b->buf; i < b->lines; i++, s += strlen(s) + 1) {
+				retime_line(s, fp, &rs);
+			}
+			b->failed = (fclose(fp) != 0);
+		}
+		pipe_push(&pl->done, b);
+	}
+	pipe_push(&pl->done, NULL);
+	return NULL;
+}
+
+/* the writer stage: the output of one batch is written while the next 
+ * batches are being filled, then the batch goes back to the reader.
+ * Nothing is written after a batch lost its output */
+static void *pipe_writer(void *arg)
+{
+	struct	PipeLine	*pl = arg;
+	struct	PipeBatch	*b;
+
+	while ((b = pipe_pop(&pl->done)) != NULL) {
+		if (b->failed) {
+			__atomic_store_n(&pl->failed, 1, __ATOMIC_RELEASE);
+		}
+		if (b->obuf && !pl->failed) {
+			fwrite(b->obuf, 1, b->olen, pl->fout);
+		}
+		free(b->obuf);
+		pipe_push(&pl->idle, b);
+	}
+	fflush(pl->fout);
+	return NULL;
+}
+
+/* retime by three pipelined stages: reading and decoding in this thread,
+ * transforming and writing in two threads. The stages pass the batches of
+ * lines by the lock-free rings, which recycle the batches in a loop, so 
+ * the throughput is bound by the slowest stage only */
+static int pipe_retiming(FILE *fin, FILE *fout)
+{
+	struct	PipeLine	*pl;
+	struct	PipeBatch	*b;
+	pthread_t	tid[2];
+	int	i, used, eof, failed;
+
+	if ((pl = calloc(1, sizeof(struct PipeLine))) == NULL) {
+		return -1;
+	}
+	if ((pl->batch = calloc(PIPE_RING, sizeof(struct PipeBatch))) == NULL) {
+		free(pl);
+		return -1;
+	}
+	pl->fout = fout;
+	for (i = 0; i < PIPE_RING; i++) {
+		pipe_push(&pl->idle, &pl->batch[i]);
+	}
+	if (pthread_create(&tid[0], NULL, pipe_transform, pl)) {
+		free(pl->batch);
+		free(pl);
+		return -1;
+	}
+	if (pthread_create(&tid[1], NULL, pipe_writer, pl)) {
+		pipe_push(&pl->todo, NULL);
+		while (pipe_pop(&pl->done) != NULL);
+		pthread_join(tid[0], NULL);
+		free(pl->batch);
+		free(pl);
+		return -1;
+	}
+
+	/* stop reading once the output was lost */
+	for (eof = 0; !eof; ) {
+		b = pipe_pop(&pl->idle);
+		if (__atomic_load_n(&pl->failed, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		/* leave room for the longest line and its decoding */
+		for (b->lines = used = 0; PIPE_BATCH - used > UTF_LINE + 8; b->lines++) {
+			if (utf_readline(fin, b->buf + used, UTF_LINE + 7) <= 0) {
+				eof = 1;
+				break;
+			}
+			used += strlen(b->buf + used) + 1;
+		}
+		pipe_push(&pl->todo, b);
+	}
+	pipe_push(&pl->todo, NULL);
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+	failed = pl->failed;
+	free(pl->batch);
+	free(pl);
+	return failed;
+}
+
+static void chunk_unload(struct RtData *rd)
+{
+	if (rd->mapped) {
+		munmap(rd->base, rd->mapped);
+	} else {
+		free(rd->base);
+	}
+}
+
+/* tweak the time stamps in one line of subtitle and output it */
+static int retime_line(char *buf, FILE *fout, struct RtState *rs)
+{
+	char	*s, *layer;
+	time_t	ms, ms_in, tm_in, tm_out;
+	int	n, style;
+
+	if (chop_filter(buf, rs)) {
+		return 0;	/* skip the specified subtitles */
+	}
+
+	/* skip and output the whitespaces */
+	for (s = buf; (*s > 0) && (*s <= 0x20); s++) fputc(*s, fout);
+	
+	/* SRT: 00:02:17,440 --> 00:02:20,375
+	 * ASS: Dialogue: Marked=0,0:02:42.42,0:02:44.15,Wolf main,
+	 *           autre,0000,0000,0000,,Toujours rien. */
+	if (!strncmp(s, "Dialogue:", 9)) {	/* ASS/SSA timestamp */
+		layer = s + 9;
+		/* output everything before the first timestamp */
+		while (*s && (*s != ',')) fputc(*s++, fout);
+		/* output the ',' also */
+		if (*s) fputc(*s++, fout);
+		/* read and skip the first timestamp */
+		ms_in = strtoms(s, &n, &style);
+		s += n;
+		/* output the tweaked timestamp */
+		tm_in = tweaktime(ms_in);
+		fputs(mstostr(tm_in, style), fout);
+		/* output everything before the second timestamp */
+		while (*s && (*s != ',')) fputc(*s++, fout);
+		/* output the ',' also */
+		if (*s) fputc(*s++, fout);
+		/* read and skip the second timestamp */
+		ms = strtoms(s, &n, &style);
+		s += n;
+		/* output the tweaked timestamp */
+		tm_out = tweakend(ms, ms_in, tm_in);
+		fputs(mstostr(tm_out, style), fout);
+		if (cue_enable) {
+			cue_collect(tm_in, tm_out, layer, s);
+		}
+	} else if ((ms_in = strtoms(s, &n, &style)) != -1) {	/* SRT timestamp */
+		/* skip the first timestamp */
+		s += n;
+		/* output the tweaked timestamp */
+		tm_in = tweaktime(ms_in);
+		fputs(mstostr(tm_in, style), fout);
+
+		/* output everything before the second timestamp */
+		while (*s && !isdigit(*s)) fputc(*s++, fout);
+		/* read and skip the second timestamp */
+		ms = strtoms(s, &n, &style);
+		s += n;
+		/* output the tweaked timestamp */
+		tm_out = tweakend(ms, ms_in, tm_in);
+		fputs(mstostr(tm_out, style), fout);
+		if (cue_enable) {
+			cue_collect(tm_in, tm_out, NULL, s);
+		}
+	} else {
+		if (cue_enable) {
+			cue_text(buf);	/* before reordering the number */
+		}
+		if ((rs->srtsn > 0) && is_number(s)) {
+			/* SRT serial numbers to be re-ordered */
+			fprintf(fout, "%d", rs->srtsn++);
+			while (isdigit(*s)) s++;
+		}
+	}
+	/* output rest of things */
+	fputs(s, fout);
+	return 0;
+}
+
+static int utf_open(FILE *fin, FILE *fout, int cp)
+{
+	int	n;
+
+	if (utf_auto) {
+		utf_index = -1;	/* every file has its own guess */
+	}
+	if ((n = utf_bom_detect(fin)) >= 0) {
+		utf_index = n;
+	} else if (utf_auto) {
+		utf_index = utf_guess(fin);
+	}
+	if (utf_index < 0) {
+		/* no codepage specified: default IO */
+		return utf_index;
+	}
+	if (utf_index != cp) {
+		/* different input/output codepage: need iconv */
+		utf_iconv = iconv_open(bom_codepage[cp].iconv_name,
+				bom_codepage[utf_index].iconv_name);
+		if (utf_iconv == (iconv_t) -1) {
+			return utf_index;
+		}
+	}
+
+	/* same input/output codepage or successful iconv, 
+	 * probably need to write a BOM explicity 
+	 * except UTF-8 and User defined codepage */
+	if ((cp > 0) && (cp < BOMLEN)) {
+		fwrite(bom_codepage[cp].magic, 1, 
+				bom_codepage[cp].magic_len, fout);
+	}
+	return utf_index;
+}
+
+static int utf_readline(FILE *fin, char *buf, int len)
+{
+	size_t	in_bytes_left, out_bytes_left;
+	char	rbuf[4090], *in_buf;
+	int	i, n;
+
+	if ((utf_index < 0) || (bom_codepage[utf_index].width == 1)) {
+		if (utf_smp_idx < utf_smp_len) {
+			/* consume the read-ahead bytes first */
+			for (i = 0; (i < sizeof(rbuf)-2) && 
+					(utf_smp_idx < utf_smp_len); ) {
+				if ((rbuf[i++] = utf_sample[utf_smp_idx++]) == 0xa) {
+					break;
+				}
+			}
+			rbuf[i] = 0;
+			if ((rbuf[i-1] != 0xa) && (i < sizeof(rbuf)-2)) {
+				fgets(&rbuf[i], sizeof(rbuf)-i-1, fin);
+			}
+		} else if (fgets(rbuf, sizeof(rbuf)-1, fin) == NULL) {
+			return -1;
+		}
+		if (utf_iconv == (iconv_t) -1) {
+			n = strlen(rbuf);
+			n = (n < len - 1) ? n : len - 1;
+			memcpy(buf, rbuf, n);
+			buf[n] = 0;
+			return n;
+		}
+		in_bytes_left  = strlen(rbuf);
+		out_bytes_left = len;
+		in_buf = (char*)rbuf;
+		// https://stackoverflow.com/questions/14148814/c-using-of-iconv-on-windows-with-mingw-compiler
+		// utf_iconv = iconv_open("UTF-8", "WINDOWS-1251");
+		iconv(utf_iconv, &in_buf, &in_bytes_left, &buf, &out_bytes_left);
+		len -= (int)out_bytes_left;
+		*buf = 0;
+		return len;
+	}
+
+	/* cut the long line as fgets() does; a unit of 2 bytes could be 
+	 * 3 bytes in UTF-8 so the line must fit in the 'len' after iconv */
+	n = (len / 3) * 2;
+	n = (n < (int)sizeof(rbuf) - 8) ? n - n % 4 : (int)sizeof(rbuf) - 8;
+	i = 0;
+	while ((i < n) && utf_read_unit(&rbuf[i], bom_codepage[utf_index].width, fin)) {
+		if (utf_lr(&rbuf[i])) {
+			i += bom_codepage[utf_index].width;
+			break;
+		}
+		i += bom_codepage[utf_index].width;
+	}
+	if (utf_iconv == (iconv_t) -1) {
+		perror("iconv");
+		return 0;
+	}
+
+	in_bytes_left  = i;
+	out_bytes_left = len;
+	in_buf = (char*)rbuf;
+	iconv(utf_iconv, &in_buf, &in_bytes_left, &buf, &out_bytes_left);
+	len -= (int)out_bytes_left;
+	*buf = 0;
+	return len;
+}
+
+/* read a character unit of 2 or 4 bytes, the read-ahead bytes first */
+static int utf_read_unit(char *s, int width, FILE *fin)
+{
+	int	i;
+
+	for (i = 0; (i < width) && (utf_smp_idx < utf_smp_len); i++) {
+		s[i] = utf_sample[utf_smp_idx++];
+	}
+	if (i == width) {
+		return 1;
+	}
+	return fread(s + i, width - i, 1, fin);
+}
+
+static int utf_lr(char *s)
+{
+	if ((utf_index < 0) || (bom_codepage[utf_index].width == 1)) {
+		return (*s == 0xa);
+	}
+	if (bom_codepage[utf_index].width == 2) {
+		if (bom_codepage[utf_index].endian == 0) {	/* LE */
+			return (!memcmp(s, "\xa\0", 2));
+		} else {
+			return (!memcmp(s, "\0\xa", 2));
+		}
+	}
+	if (bom_codepage[utf_index].endian == 0) {	/* LE */
+		return (!memcmp(s, "\xa\0\0\0", 4));
+	}
+	return (!memcmp(s, "\0\0\0\xa", 4));
+}
+
+static int utf_bom_detect(FILE *fin)
+{
+	int	c, k, part, m = -1;
+
+	utf_smp_len = utf_smp_idx = 0;
+	while (utf_smp_len < 4) {
+		if ((c = fgetc(fin)) == EOF) {
+			break;
+		}
+		utf_sample[utf_smp_len++] = (char) c;
+		for (k = part = 0; k < BOMLEN; k++) {
+			if (!memcmp(bom_codepage[k].magic, utf_sample, 
+						utf_smp_len)) {
+				if (bom_codepage[k].magic_len > utf_smp_len) {
+					part++;	/* partial matching */
+				} else {
+					m = k;	/* the matching codepage */
+				}
+			}
+		}
+		if (!part) {	/* no longer BOM, like UTF-32LE over UTF-16LE */
+			break;	/* keep the read-ahead bytes */
+		}
+	}
+	if (m >= 0) {
+		utf_smp_idx = bom_codepage[m].magic_len;
+	}
+	return m;
+}
+
+/* byte statistics of the sample: zero bytes by the position of modulo 4,
+ * bytes from 0x80, bytes from 0xC0 and the ASCII letters */
+struct	UtfStat	{
+	int	zero[4];
+	int	high;
+	int	c0ff;
+	int	alpha;
+};
+
+static void utf_statistic(unsigned char *s, int len, struct UtfStat *st)
+{
+	int	i = 0;
+
+	memset(st, 0, sizeof(struct UtfStat));
+#ifdef	__SSE2__
+	__m128i	zero = _mm_setzero_si128();
+	__m128i	c0 = _mm_set1_epi8((char)0xBF);
+	__m128i	ca = _mm_set1_epi8('a' - 1);
+	__m128i	cz = _mm_set1_epi8('z' + 1);
+	__m128i	lc = _mm_set1_epi8(0x20);
+	__m128i	v, u;
+	int	zm;
+
+	for ( ; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((__m128i *)(s + i));
+		st->high += __builtin_popcount(_mm_movemask_epi8(v));
+		/* the letters in lower case; the high bytes are negative */
+		u = _mm_or_si128(v, lc);
+		st->alpha += __builtin_popcount(_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpgt_epi8(u, ca), 
+				_mm_cmplt_epi8(u, cz))));
+		if (st->high) {
+			/* signed compare: 0xC0-0xFF are -64 to -1 */
+			st->c0ff += __builtin_popcount(_mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpgt_epi8(v, c0), 
+					_mm_cmplt_epi8(v, zero))));
+		}
+		if ((zm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) != 0) {
+			st->zero[0] += __builtin_popcount(zm & 0x1111);
+			st->zero[1] += __builtin_popcount(zm & 0x2222);
+			st->zero[2] += __builtin_popcount(zm & 0x4444);
+			st->zero[3] += __builtin_popcount(zm & 0x8888);
+		}
+	}
+#endif
+	for ( ; i < len; i++) {
+		if (s[i] == 0) {
+			st->zero[i & 3]++;
+		} else if (s[i] >= 0xC0) {
+			st->high++;
+			st->c0ff++;
+		} else if (s[i] >= 0x80) {
+			st->high++;
+		} else if (((s[i] | 0x20) >= 'a') && ((s[i] | 0x20) <= 'z')) {
+			st->alpha++;
+		}
+	}
+}
+
+/* validate the UTF-8 sequences. The sample may cut the last character */
+static int utf_valid_utf8(unsigned char *s, int len)
+{
+	int	i = 0, n;
+
+	while (i < len) {
+#ifdef	__SSE2__
+		/* fast skipping the ASCII blocks */
+		while ((i + 16 <= len) && !_mm_movemask_epi8(
+				_mm_loadu_si128((__m128i *)(s + i)))) {
+			i += 16;
+		}
+		if (i >= len) {
+			break;
+		}
+#endif
+		if (s[i] < 0x80) {
+			i++;
+			continue;
+		}
+		if ((s[i] >= 0xC2) && (s[i] <= 0xDF)) {
+			n = 1;
+		} else if ((s[i] >= 0xE0) && (s[i] <= 0xEF)) {
+			n = 2;
+		} else if ((s[i] >= 0xF0) && (s[i] <= 0xF4)) {
+			n = 3;
+		} else {
+			return 0;
+		}
+		/* overlong and surrogates */
+		if ((i + 1 < len) && (((s[i] == 0xE0) && (s[i+1] < 0xA0)) ||
+				((s[i] == 0xED) && (s[i+1] > 0x9F)) ||
+				((s[i] == 0xF0) && (s[i+1] < 0x90)) ||
+				((s[i] == 0xF4) && (s[i+1] > 0x8F)))) {
+			return 0;
+		}
+		for (i++; n && (i < len); n--, i++) {
+			if ((s[i] & 0xC0) != 0x80) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* count the double byte pairs in the sample by the ranges of the lead bytes
+ * and the trail bytes. The 'low' counts the trail bytes in 0x40-0x7E, which
+ * are frequent in BIG5 but rare in GB2312 */
+struct	DbcsStat {
+	int	pairs;
+	int	error;
+	int	low;
+	int	kana;		/* lead bytes 0x81-0x9F */
+};
+
+static void utf_dbcs(unsigned char *s, int len, int sjis, struct DbcsStat *st)
+{
+	int	i;
+
+	memset(st, 0, sizeof(struct DbcsStat));
+	for (i = 0; i < len; i++) {
+		if (s[i] < 0x80) {
+			continue;
+		}
+		if (sjis && (s[i] >= 0xA1) && (s[i] <= 0xDF)) {
+			continue;	/* half width katakana */
+		}
+		if ((s[i] == 0x80) || (s[i] == 0xFF) || 
+				(sjis && ((s[i] == 0xA0) || (s[i] > 0xFC)))) {
+			st->error++;
+			continue;
+		}
+		if (i + 1 == len) {
+			break;		/* cut by the sample */
+		}
+		if ((s[i+1] < 0x40) || (s[i+1] == 0x7F) || (s[i+1] == 0xFF) ||
+				(sjis && (s[i+1] > 0xFC))) {
+			st->error++;
+			continue;
+		}
+		st->pairs++;
+		if (s[i+1] < 0x7F) {
+			st->low++;
+		}
+		if (s[i] < 0xA0) {
+			st->kana++;
+		}
+		i++;
+	}
+}
+
+/* guess the encoding of files without BOM by sampling the first few KB.
+ * Returns -1 for ASCII and UTF-8 so the contents simply pass through */
+static int utf_guess(FILE *fin)
+{
+	struct	UtfStat	st;
+	struct	DbcsStat sj, gb;
+	unsigned char	*s = (unsigned char *) utf_sample;
+	int	len;
+
+	utf_smp_len += fread(utf_sample + utf_smp_len, 1, 
+			UTF_SAMPLE - utf_smp_len, fin);
+	if ((len = utf_smp_len) == 0) {
+		return -1;
+	}
+
+	utf_statistic(s, len, &st);
+
+	/* BOM-less UTF-16/32 leave zero bytes in the high order */
+	if ((st.zero[0] + st.zero[1] + st.zero[2] + st.zero[3]) * 8 > len) {
+		if ((st.zero[1] * 8 > len) && (st.zero[2] * 8 > len)) {
+			if (st.zero[0] * 8 < st.zero[3]) {
+				return utf_bom_user_defined("UTF-32LE");
+			}
+			if (st.zero[3] * 8 < st.zero[0]) {
+				return utf_bom_user_defined("UTF-32BE");
+			}
+		}
+		if ((st.zero[0] + st.zero[2]) * 4 < st.zero[1] + st.zero[3]) {
+			return utf_bom_user_defined("UTF-16LE");
+		}
+		if ((st.zero[1] + st.zero[3]) * 4 < st.zero[0] + st.zero[2]) {
+			return utf_bom_user_defined("UTF-16BE");
+		}
+	}
+	if ((st.high == 0) || utf_valid_utf8(s, len)) {
+		return -1;	/* ASCII or UTF-8 */
+	}
+
+	/* the double byte codepages must decode the sample in pairs, and
+	 * enough of them, otherwise a few high bytes pair up by chance.
+	 * Japanese is mostly Kana and Kanji in the lead bytes of 0x81-0x9F */
+	utf_dbcs(s, len, 1, &sj);
+	if ((sj.pairs >= 8) && (sj.error * 50 <= sj.pairs) && 
+			(sj.kana * 2 > sj.pairs)) {
+		return utf_bom_user_defined("SHIFT_JIS");
+	}
+	utf_dbcs(s, len, 0, &gb);
+	if ((gb.pairs >= 8) && (gb.error * 50 <= gb.pairs)) {
+		if (gb.low * 10 > gb.pairs) {
+			return utf_bom_user_defined("BIG5");
+		}
+		return utf_bom_user_defined("GBK");
+	}
+	/* Cyrillic letters are 0xC0-0xFF in CP1251, and they outnumber the
+	 * Latin letters. The accented letters of Latin-1 are 0xC0-0xFF too,
+	 * but they are a few among the ASCII letters */
+	if ((st.c0ff * 10 > st.high * 6) && (st.c0ff > st.alpha)) {
+		return utf_bom_user_defined("CP1251");
+	}
+	return -1;
+}
+
+static int utf_bom_user_defined(char *s)
+{
+	int	i;
+
+	for (i = 0; i < BOMLEN; i++) {
+		if (!strcasecmp(bom_codepage[i].iconv_name, s)) {
+			return i;
+		}
+	}
+	strncpy(bom_codepage[i].iconv_name, s, sizeof(bom_user_defined)-1);
+	bom_codepage[i].width  = 1;
+	bom_codepage[i].endian = 0;
+	if (strstr(s, "16")) {
+		bom_codepage[i].width = 2;
+	} else if (strstr(s, "32")) {
+		bom_codepage[i].width = 4;
+	}
+	if (strstr(s, "BE") || strstr(s, "be")) {
+		bom_codepage[i].endian = 1;
+	}
+	return i;
+}
+
+/* recognise the codec by the magic bytes of the stream */
+static int zio_magic(unsigned char *s, int len)
+{
+	if ((len >= 2) && (s[0] == 0x1f) && (s[1] == 0x8b)) {
+		return ZIO_GZIP;
+	}
+	if ((len >= 4) && !memcmp(s, "\x28\xb5\x2f\xfd", 4)) {
+		return ZIO_ZSTD;
+	}
+	return ZIO_NONE;
+}
+
+/* recognise the codec by the extension of the file name.
+ * Returns -1 if the codec was not built in */
+static int zio_codec(char *fname)
+{
+	char	*p;
+
+	if ((p = strrchr(fname, '.')) == NULL) {
+		return ZIO_NONE;
+	}
+	if (!strcasecmp(p, ".gz")) {
+		return zio_support(ZIO_GZIP, fname);
+	}
+	if (!strcasecmp(p, ".zst")) {
+		return zio_support(ZIO_ZSTD, fname);
+	}
+	return ZIO_NONE;
+}
+
+/* the codec, or -1 if it was not built in */
+static int zio_support(int codec, char *fname)
+{
+	char	*name = NULL;
+
+#ifndef	HAVE_ZLIB
+	if (codec == ZIO_GZIP) {
+		name = "gzip";
+	}
+#endif
+#ifndef	HAVE_ZSTD
+	if (codec == ZIO_ZSTD) {
+		name = "zstd";
+	}
+#endif
+	if (name == NULL) {
+		return codec;
+	}
+	fprintf(stderr, "%s%s%s stream is not supported.\n", 
+			fname ? fname : "", fname ? ": " : "", name);
+	return -1;
+}
+
+static ssize_t zio_read(void *cookie, char *buf, size_t size)
+{
+	struct	ZioCookie	*zc = cookie;
+	size_t	n = 0;
+
+	while ((n == 0) && (size > 0)) {
+		if ((zc->pos == zc->len) && !zc->eof) {
+			zc->len = fread(zc->buf, 1, ZIO_BUFSIZE, zc->fp);
+			zc->pos = 0;
+			zc->eof = (zc->len == 0);
+		}
+		if (zc->codec == ZIO_NONE) {
+			n = zc->len - zc->pos;
+			n = (n > size) ? size : n;
+			memcpy(buf, zc->buf + zc->pos, n);
+			zc->pos += n;
+		}
+#ifdef	HAVE_ZLIB
+		if (zc->codec == ZIO_GZIP) {
+			int	rc;
+
+			zc->zs.next_in   = zc->buf + zc->pos;
+			zc->zs.avail_in  = zc->len - zc->pos;
+			zc->zs.next_out  = (unsigned char *) buf;
+			zc->zs.avail_out = size;
+			rc = inflate(&zc->zs, Z_NO_FLUSH);
+			n = size - zc->zs.avail_out;
+			zc->pos = zc->len - zc->zs.avail_in;
+			if (rc == Z_STREAM_END) {
+				/* concatenated gzip members */
+				inflateReset(&zc->zs);
+			} else if ((rc != Z_OK) && (rc != Z_BUF_ERROR)) {
+				fprintf(stderr, "gzip: %s\n", zc->zs.msg ? 
+						zc->zs.msg : "broken stream");
+				return -1;
+			}
+		}
+#endif
+#ifdef	HAVE_ZSTD
+		if (zc->codec == ZIO_ZSTD) {
+			ZSTD_inBuffer	zin = { zc->buf, zc->len, zc->pos };
+			ZSTD_outBuffer	zout = { buf, size, 0 };
+			size_t	rc;
+
+			rc = ZSTD_decompressStream(zc->zd, &zout, &zin);
+			if (ZSTD_isError(rc)) {
+				fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(rc));
+				return -1;
+			}
+			n = zout.pos;
+			zc->pos = zin.pos;
+		}
+#endif
+		if (zc->eof) {
+			break;
+		}
+	}
+	return n;
+}
+
+#ifdef	HAVE_ZLIB
+static int zio_deflate(struct ZioCookie *zc, int finish)
+{
+	int	rc;
+
+	do {
+		zc->zs.next_out  = zc->buf;
+		zc->zs.avail_out = ZIO_BUFSIZE;
+		rc = deflate(&zc->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+		fwrite(zc->buf, 1, ZIO_BUFSIZE - zc->zs.avail_out, zc->fp);
+	} while ((zc->zs.avail_out == 0) || (finish && (rc == Z_OK)));
+	return (rc == Z_STREAM_ERROR) ? -1 : 0;
+}
+#endif
+
+static ssize_t zio_write(void *cookie, const char *buf, size_t size)
+{
+	struct	ZioCookie	*zc = cookie;
+
+#ifdef	HAVE_ZLIB
+	if (zc->codec == ZIO_GZIP) {
+		zc->zs.next_in  = (unsigned char *) buf;
+		zc->zs.avail_in = size;
+		if (zio_deflate(zc, 0) < 0) {
+			return -1;
+		}
+		return size;
+	}
+#endif
+#ifdef	HAVE_ZSTD
+	if (zc->codec == ZIO_ZSTD) {
+		ZSTD_inBuffer	zin = { buf, size, 0 };
+		ZSTD_outBuffer	zout;
+		size_t	rc;
+
+		while (zin.pos < zin.size) {
+			zout.dst  = zc->buf;
+			zout.size = ZIO_BUFSIZE;
+			zout.pos  = 0;
+			rc = ZSTD_compressStream2(zc->zc, &zout, &zin, 
+					ZSTD_e_continue);
+			if (ZSTD_isError(rc)) {
+				return -1;
+			}
+			fwrite(zc->buf, 1, zout.pos, zc->fp);
+		}
+		return size;
+	}
+#endif
+	return fwrite(buf, 1, size, zc->fp);
+}
+
+static int zio_close(void *cookie)
+{
+	struct	ZioCookie	*zc = cookie;
+	int	rc;
+
+#ifdef	HAVE_ZLIB
+	if (zc->codec == ZIO_GZIP) {
+		if (zc->writing) {
+			zc->zs.avail_in = 0;
+			zio_deflate(zc, 1);
+			deflateEnd(&zc->zs);
+		} else {
+			inflateEnd(&zc->zs);
+		}
+	}
+#endif
+#ifdef	HAVE_ZSTD
+	if ((zc->codec == ZIO_ZSTD) && zc->writing) {
+		ZSTD_inBuffer	zin = { NULL, 0, 0 };
+		ZSTD_outBuffer	zout;
+		size_t	left;
+
+		do {
+			zout.dst  = zc->buf;
+			zout.size = ZIO_BUFSIZE;
+			zout.pos  = 0;
+			left = ZSTD_compressStream2(zc->zc, &zout, &zin, 
+					ZSTD_e_end);
+			fwrite(zc->buf, 1, zout.pos, zc->fp);
+		} while (left && !ZSTD_isError(left));
+		ZSTD_freeCStream(zc->zc);
+	} else if (zc->codec == ZIO_ZSTD) {
+		ZSTD_freeDStream(zc->zd);
+	}
+#endif
+	rc = (zc->fp == stdin) ? 0 : fclose(zc->fp);
+	free(zc->buf);
+	free(zc);
+	return rc;
+}
+
+#if	!defined(__GLIBC__) && !defined(__CYGWIN__)
+static int zio_read_bsd(void *cookie, char *buf, int size)
+{
+	return (int) zio_read(cookie, buf, size);
+}
+
+static int zio_write_bsd(void *cookie, const char *buf, int size)
+{
+	return (int) zio_write(cookie, buf, size);
+}
+#endif
+
+static FILE *zio_open(FILE *fp, int codec, int writing, void *pre, int n)
+{
+	struct	ZioCookie	*zc;
+	FILE	*zf;
+
+	if ((zc = calloc(1, sizeof(struct ZioCookie))) == NULL) {
+		return NULL;
+	}
+	if ((zc->buf = malloc(ZIO_BUFSIZE)) == NULL) {
+		free(zc);
+		return NULL;
+	}
+	zc->fp = fp;
+	zc->codec = codec;
+	zc->writing = writing;
+	if (pre && (n > 0)) {	/* the bytes already read from the stream */
+		memcpy(zc->buf, pre, n);
+		zc->len = n;
+	}
+#ifdef	HAVE_ZLIB
+	if ((codec == ZIO_GZIP) && writing) {
+		deflateInit2(&zc->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				15 + 16, 8, Z_DEFAULT_STRATEGY);
+	} else if (codec == ZIO_GZIP) {
+		inflateInit2(&zc->zs, 15 + 32);
+	}
+#endif
+#ifdef	HAVE_ZSTD
+	if ((codec == ZIO_ZSTD) && writing) {
+		zc->zc = ZSTD_createCStream();
+	} else if (codec == ZIO_ZSTD) {
+		zc->zd = ZSTD_createDStream();
+	}
+#endif
+
+#if	defined(__GLIBC__) || defined(__CYGWIN__)
+	cookie_io_functions_t	zfunc = { zio_read, zio_write, NULL, zio_close };
+	zf = fopencookie(zc, writing ? "w" : "r", zfunc);
+#else
+	zf = funopen(zc, writing ? NULL : zio_read_bsd,
+			writing ? zio_write_bsd : NULL, NULL, zio_close);
+#endif
+	if (zf == NULL) {
+		free(zc->buf);
+		free(zc);
+	}
+	return zf;
+}
+
+/* detect the compressed input by its magic bytes. The magic bytes can not
+ * be put back to a pipe so they would be prefilled into the cookie.
+ * A stream compressed by the codec not built in can not be retimed as 
+ * text, so it is closed and returns NULL */
+static FILE *zio_input(FILE *fin, int *codec)
+{
+	unsigned char	magic[4];
+	FILE	*zf;
+	int	n, cc;
+
+	if (codec) {
+		*codec = ZIO_NONE;
+	}
+	n = fread(magic, 1, sizeof(magic), fin);
+	if ((cc = zio_support(zio_magic(magic, n), NULL)) < 0) {
+		fclose(fin);
+		return NULL;
+	}
+	if ((cc == ZIO_NONE) && (fseek(fin, -n, SEEK_CUR) == 0)) {
+		return fin;	/* seekable file */
+	}
+	if ((zf = zio_open(fin, cc, 0, magic, n)) == NULL) {
+		fclose(fin);
+		return NULL;
+	}
+	if (codec) {
+		*codec = cc;
+	}
+	return zf;
+}
+
+static FILE *zio_output(FILE *fout, int codec)
+{
+	FILE	*zf;
+
+	if ((fout == NULL) || (codec == ZIO_NONE)) {
+		return fout;
+	}
+	if ((zf = zio_open(fout, codec, 1, NULL, 0)) == NULL) {
+		return fout;
+	}
+	return zf;
+}
+
+/* XXH64 by streaming, so the manifest needn't hold the whole file */
+#define XXH_P1	11400714785074694791ULL
+#define XXH_P2	14029467366897019727ULL
+#define XXH_P3	1609587929392839161ULL
+#define XXH_P4	9650029242287828579ULL
+#define XXH_P5	2870177450012600261ULL
+#define XXH_ROTL(x,r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t xxh_read64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | 
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | 
+		((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t val)
+{
+	acc += val * XXH_P2;
+	acc  = XXH_ROTL(acc, 31);
+	return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+/* hash the file by its bytes on the disk, compressed or not */
+static int xxh64_file(char *fname, uint64_t *hash)
+{
+	unsigned char	buf[65536 + 32], *p;
+	uint64_t	v[4], h, total = 0;
+	size_t	n, left = 0;
+	FILE	*fp;
+	int	i;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		return -1;
+	}
+	v[0] = XXH_P1 + XXH_P2;
+	v[1] = XXH_P2;
+	v[2] = 0;
+	v[3] = -XXH_P1;
+	/* the 'left' bytes less than a stripe are moved to the head */
+	while ((n = fread(buf + left, 1, 65536, fp)) > 0) {
+		total += n;
+		n += left;
+		for (p = buf; p + 32 <= buf + n; p += 32) {
+			for (i = 0; i < 4; i++) {
+				v[i] = xxh_round(v[i], xxh_read64(p + i * 8));
+			}
+		}
+		left = buf + n - p;
+		memmove(buf, p, left);
+	}
+	fclose(fp);
+
+	if (total >= 32) {
+		h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) + 
+			XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+		for (i = 0; i < 4; i++) {
+			h = xxh_merge(h, v[i]);
+		}
+	} else {
+		h = XXH_P5;
+	}
+	h += total;
+	for (p = buf; p + 8 <= buf + left; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h  = XXH_ROTL(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= buf + left) {
+		h ^= ((uint64_t)p[0] | ((uint64_t)p[1] << 8) | 
+			((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)) * XXH_P1;
+		h  = XXH_ROTL(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for ( ; p < buf + left; p++) {
+		h ^= *p * XXH_P5;
+		h  = XXH_ROTL(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	*hash = h;
+	return 0;
+}
+
+/* the transform spec which was applied to the file */
+static char *manifest_spec(void)
+{
+	static	char	spec[160];
+
+	snprintf(spec, sizeof(spec), 
+			"off=%lld,scl=%.9g,span=%lld:%lld,chop=%d:%d,sn=%d",
+			(long long) tm_offset, tm_scale, 
+			(long long) tm_range[0], (long long) tm_range[1],
+			tm_chop[0], tm_chop[1], tm_srtsn);
+	return spec;
+}
+
+/* read the records appended since the last reading. The manifest must
+ * be locked already. Each record is like:
+ *   IN_HASH OUT_HASH SPEC FILENAME
+ * where the OUT_HASH is @PID when the file is being processed, and '-'
+ * when the claim was released without the output */
+static int manifest_load(void)
+{
+	struct	MfRecord	*rec;
+	char	buf[4096], out[32], spec[160], name[4096];
+	long	n;
+
+	fseek(mani_fp, mani_offset, SEEK_SET);
+	while (fgets(buf, sizeof(buf), mani_fp)) {
+		if (buf[strlen(buf)-1] != '\n') {
+			break;	/* partially appended; read it next time */
+		}
+		mani_offset += strlen(buf);
+		if (mani_num >= mani_max) {
+			n = mani_max ? mani_max * 2 : 256;
+			rec = realloc(mani_list, n * sizeof(struct MfRecord));
+			if (rec == NULL) {
+				return -1;
+			}
+			mani_list = rec;
+			mani_max  = n;
+		}
+		rec = &mani_list[mani_num];
+		if (sscanf(buf, "%llx %31s %159s %4095[^\n]", 
+				(unsigned long long *) &rec->in, 
+				out, spec, name) != 4) {
+			continue;	/* comments or broken lines */
+		}
+		rec->pid = 0;
+		rec->out = 0;
+		if (out[0] == '@') {
+			rec->pid = (pid_t) strtol(out + 1, NULL, 10);
+		} else if (out[0] == '-') {
+			rec->out = 0;	/* released, matches no output */
+		} else {
+			rec->out = strtoull(out, NULL, 16);
+		}
+		rec->spec = strdup(spec);
+		rec->name = strdup(name);
+		mani_num++;
+	}
+	return mani_num;
+}
+
+static int manifest_open(char *fname)
+{
+	if ((mani_fp = fopen(fname, "a+")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
+
+/* check the file before processing. Returns 1 if the file was an output 
+ * of the same transform, or it's being processed by another worker.
+ * Otherwise claims the file by a record of the current PID. The hashing 
+ * must be inside the lock so it won't read a file half processed */
+static int manifest_claim(char *fname)
+{
+	struct	MfRecord	*rec;
+	uint64_t	pending = 0;
+	char	*spec;
+	int	i, busy = 0;
+
+	spec = manifest_spec();
+	flock(fileno(mani_fp), LOCK_EX);
+	manifest_load();
+	for (i = 0, rec = mani_list; i < mani_num; i++, rec++) {
+		if (strcmp(rec->name, fname)) {
+			continue;
+		}
+		if (rec->pid) {
+			busy = (rec->pid != getpid()) && !kill(rec->pid, 0);
+			pending = rec->in;
+		} else if (rec->in == pending) {
+			busy = 0;	/* the claim was finished */
+		}
+	}
+	if (busy) {
+		fprintf(stderr, "%s: being processed by another worker\n", fname);
+		flock(fileno(mani_fp), LOCK_UN);
+		return 1;
+	}
+	if (xxh64_file(fname, &mani_hash) < 0) {
+		flock(fileno(mani_fp), LOCK_UN);
+		return 0;	/* let the caller report the error */
+	}
+	for (i = 0, rec = mani_list; i < mani_num; i++, rec++) {
+		if (!rec->pid && (rec->out == mani_hash) && 
+				!strcmp(rec->spec, spec)) {
+			fprintf(stderr, "%s: already retimed by %s\n", 
+					fname, spec);
+			flock(fileno(mani_fp), LOCK_UN);
+			return 1;
+		}
+	}
+	fprintf(mani_fp, "%016llx @%d %s %s\n", (unsigned long long) mani_hash,
+			(int) getpid(), spec, fname);
+	fflush(mani_fp);
+	mani_claimed = 1;
+	flock(fileno(mani_fp), LOCK_UN);
+	return 0;
+}
+
+/* record the hash of the output after processing */
+static int manifest_commit(char *fname)
+{
+	uint64_t	out;
+
+	mani_claimed = 0;
+	if (xxh64_file(fname, &out) < 0) {
+		return -1;
+	}
+	flock(fileno(mani_fp), LOCK_EX);
+	fseek(mani_fp, 0, SEEK_END);
+	fprintf(mani_fp, "%016llx %016llx %s %s\n", 
+			(unsigned long long) mani_hash, 
+			(unsigned long long) out, manifest_spec(), fname);
+	fflush(mani_fp);
+	flock(fileno(mani_fp), LOCK_UN);
+	return 0;
+}
+
+/* release the claim of the file which failed, so it is neither pending
+ * for other workers nor recorded as an output */
+static int manifest_release(char *fname)
+{
+	if ((mani_fp == NULL) || !mani_claimed) {
+		return 0;
+	}
+	mani_claimed = 0;
+	flock(fileno(mani_fp), LOCK_EX);
+	fseek(mani_fp, 0, SEEK_END);
+	fprintf(mani_fp, "%016llx - %s %s\n", (unsigned long long) mani_hash,
+			manifest_spec(), fname);
+	fflush(mani_fp);
+	flock(fileno(mani_fp), LOCK_UN);
+	return 0;
+}
+
+/* apply the transform spec of a rule. The spec is in the same options as 
+ * the command line: offsets, scales, -c N:M, -r [NUM] and -s TIME [TIME] */
+static int watch_spec(char *spec)
+{
+	char	*argv[64], *p;
+	int	i, argc;
+
+	tm_offset = 0;
+	tm_scale = 0.0;
+	tm_range[0] = tm_range[1] = -1;
+	tm_chop[0] = tm_chop[1] = -1;
+	tm_srtsn = -1;
+
+	for (argc = 0, p = strtok(spec, " \t\r\n"); p && (argc < 63); 
+			p = strtok(NULL, " \t\r\n")) {
+		argv[argc++] = p;
+	}
+	for (i = 0; i < argc; i++) {
+		if ((!strcmp(argv[i], "-c") || !strcmp(argv[i], "--chop")) &&
+				(i + 1 < argc)) {
+			if (sscanf(argv[++i], "%d : %d", tm_chop, tm_chop+1) != 2) {
+				tm_chop[0] = tm_chop[1] = -1;
+			}
+		} else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--reorder")) {
+			if ((i + 1 < argc) && is_number(argv[i+1])) {
+				tm_srtsn = (int)strtol(argv[++i], NULL, 0);
+			} else {
+				tm_srtsn = 1;
+			}
+		} else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--span")) &&
+				(i + 1 < argc)) {
+			tm_range[0] = arg_offset(argv[++i]);
+			if ((i + 1 < argc) && isdigit(argv[i+1][0])) {
+				tm_range[1] = arg_offset(argv[++i]);
+			}
+		} else if (arg_offset(argv[i]) != -1) {
+			tm_offset = arg_offset(argv[i]);
+		} else if (arg_scale(argv[i]) != 0) {
+			tm_scale = arg_scale(argv[i]);
+		} else {
+			fprintf(stderr, "%s: unknown parameter in rules.\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* find the spec of the first rule whose pattern matches the file name.
+ * The rules file is read for every file so it can be edited on the fly */
+static char *watch_rule(char *name)
+{
+	FILE	*fp;
+	char	buf[1024], *p, *pattern, *spec = NULL;
+
+	if ((fp = fopen(tm_rules, "r")) == NULL) {
+		perror(tm_rules);
+		return NULL;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		for (p = buf; isspace(*p); p++);
+		if ((*p == 0) || (*p == '#')) {
+			continue;
+		}
+		for (pattern = p; *p && !isspace(*p); p++);
+		if (*p) {
+			*p++ = 0;
+		}
+		if (!fnmatch(pattern, name, 0)) {
+			spec = strdup(p);
+			break;
+		}
+	}
+	fclose(fp);
+	return spec;
+}
+
+/* retime a file landed in the watched directory, in the worker process.
+ * The output is written to a temporary file in the output directory and
+ * renamed to the same name, so the readers never see half a file */
+static int watch_retime(char *idir, char *odir, char *name)
+{
+	FILE	*fin, *fout;
+	char	*iname, *oname, *tname, *spec;
+	size_t	n;
+	mode_t	mask;
+	int	fd, codec, rc = 0;
+
+	if (tm_rules && ((spec = watch_rule(name)) != NULL)) {
+		rc = watch_spec(spec);
+		free(spec);
+		if (rc < 0) {
+			return -1;
+		}
+	}
+	if ((tm_offset == 0) && (tm_scale == 0) && (tm_srtsn < 0) &&
+			(tm_chop[0] < 0) && (tm_chop[1] < 0) && !tm_exnum) {
+		return 0;	/* nothing to do with this file */
+	}
+
+	n = strlen(idir) + strlen(odir) + strlen(name) + 16;
+	if ((iname = malloc(n * 3)) == NULL) {
+		return -1;
+	}
+	oname = iname + n;
+	tname = oname + n;
+	sprintf(iname, "%s/%s", idir, name);
+	sprintf(oname, "%s/%s", odir, name);
+	sprintf(tname, "%s/.%s.XXXXXX", odir, name);
+
+	if ((fin = fopen(iname, "r")) == NULL) {
+		perror(iname);
+		free(iname);
+		return -1;
+	}
+	if ((fin = zio_input(fin, &codec)) == NULL) {
+		free(iname);
+		return -1;
+	}
+	if ((codec == ZIO_NONE) && ((codec = zio_codec(name)) < 0)) {
+		fclose(fin);
+		free(iname);
+		return -1;
+	}
+	if ((fd = mkstemp(tname)) < 0) {
+		perror(tname);
+		fclose(fin);
+		free(iname);
+		return -1;
+	}
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	if ((fout = fdopen(fd, "w")) == NULL) {
+		perror(tname);
+		close(fd);
+		unlink(tname);
+		fclose(fin);
+		free(iname);
+		return -1;
+	}
+	fout = zio_output(fout, codec);
+	rc = retiming(fin, fout);
+	fclose(fin);
+	if (fclose(fout) || rc || rename(tname, oname)) {
+		if (!rc) {
+			perror(oname);
+		}
+		unlink(tname);
+		rc = -1;
+	} else {
+		cue_export(oname);
+	}
+	free(iname);
+	return rc;
+}
+
+/* watch the directory for the files which are closed after writing or 
+ * moved in, and retime them by the pool of 'tm_jobs' worker processes.
+ * It blocks in reading the inotify events so there is no polling */
+static int watch_dir(char *idir, char *odir)
+{
+#ifdef	__linux__
+	struct	inotify_event	*ev;
+	struct	stat	ist, ost;
+	char	buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char	*p;
+	int	fd, n, running = 0;
+
+	if (stat(idir, &ist) || !S_ISDIR(ist.st_mode)) {
+		fprintf(stderr, "%s: not a directory.\n", idir);
+		return -1;
+	}
+	if (stat(odir, &ost) || !S_ISDIR(ost.st_mode)) {
+		fprintf(stderr, "%s: not a directory.\n", odir);
+		return -1;
+	}
+	if ((ist.st_dev == ost.st_dev) && (ist.st_ino == ost.st_ino)) {
+		fprintf(stderr, "%s: the output must be in another directory.\n",
+				odir);
+		return -1;
+	}
+	if ((fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		perror("inotify");
+		return -1;
+	}
+	if (inotify_add_watch(fd, idir, IN_CLOSE_WRITE | IN_MOVED_TO | 
+				IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		perror(idir);
+		close(fd);
+		return -1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	for (;;) {
+		if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			break;
+		}
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "%s: events lost.\n", idir);
+			}
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				goto watch_end;		/* the directory is gone */
+			}
+			/* hidden files are left for the temporary files */
+			if (!ev->len || (ev->mask & IN_ISDIR) || (ev->name[0] == '.')) {
+				continue;
+			}
+			while (waitpid(-1, NULL, WNOHANG) > 0) {
+				running--;
+			}
+			if ((running >= tm_jobs) && (wait(NULL) > 0)) {
+				running--;
+			}
+			switch (fork()) {
+			case 0:
+				close(fd);
+				tm_jobs = 1;	/* one file per worker */
+				_exit(watch_retime(idir, odir, ev->name) < 0);
+			case -1:
+				perror("fork");
+				break;
+			default:
+				running++;
+				break;
+			}
+		}
+	}
+watch_end:
+	while ((running > 0) && (wait(NULL) > 0)) {
+		running--;
+	}
+	close(fd);
+	return 0;
+#else
+	fprintf(stderr, "%s: watching is not supported.\n", idir);
+	return -1;
+#endif
+}
+
+static time_t tweaktime(time_t ms)
+{
+	if (tm_range[0] > -1) {	/* check the time stamp range */
+		if (ms < tm_range[0]) {
+			return ms;
+		}
+		if ((tm_range[1] > -1) && (ms > tm_range[1])) {
+			return ms;
+		}
+	}
+	if (tm_offset) {
+		ms += tm_offset;
+	}
+	if (tm_scale != 0.0) {
+		ms *= tm_scale;
+	}
+	if (snap_num) {
+		ms = snap_time(ms);
+	}
+	return ms;
+}
+
+/* tweak the end time of the cue which starts at 'ms_in', tweaked to 'tm_in'.
+ * Snapping the end on its own would collapse a short cue onto the keyframe
+ * of its start, so it keeps the duration from the snapped start instead */
+static time_t tweakend(time_t ms, time_t ms_in, time_t tm_in)
+{
+	time_t	tm_out = tweaktime(ms);
+
+	if (snap_num && (ms > ms_in) && (tm_out <= tm_in)) {
+		ms -= ms_in;
+		if (tm_scale != 0.0) {
+			ms *= tm_scale;
+		}
+		tm_out = tm_in + (ms > 0 ? ms : 1);
+	}
+	return tm_out;
+}
+
+static int snap_compare(const void *a, const void *b)
+{
+	int64_t	x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/* make sure the list is sorted, which can be a mapped binary array */
+static int snap_sort(void)
+{
+	int64_t	*p;
+	size_t	i;
+
+	for (i = 1; (i < snap_num) && (snap_list[i-1] <= snap_list[i]); i++);
+	if (i >= snap_num) {
+		return 0;
+	}
+	if (snap_mapped) {
+		if ((p = malloc(snap_num * sizeof(int64_t))) == NULL) {
+			return -1;
+		}
+		memcpy(p, snap_list, snap_num * sizeof(int64_t));
+		munmap(snap_list, snap_mapped);
+		snap_list = p;
+		snap_mapped = 0;
+	}
+	qsort(snap_list, snap_num, sizeof(int64_t), snap_compare);
+	return 0;
+}
+
+/* load the keyframes or scene changes. A binary file is the array of 
+ * int64 milliseconds in native byte order, which is mapped as it is.
+ * A text file has one time per line: the time stamp, the milliseconds, 
+ * or the seconds in decimal like "12.345" */
+static int snap_load(char *fname)
+{
+	FILE	*fp;
+	struct	stat	st;
+	char	buf[256], *s, *endp;
+	int64_t	*p;
+	size_t	max = 0;
+	time_t	ms;
+	double	sec;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	/* the high bytes of int64 are zeros while text has none */
+	if (!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && 
+			(st.st_size >= (off_t) sizeof(int64_t)) &&
+			memchr(buf, 0, fread(buf, 1, sizeof(buf), fp))) {
+		if (st.st_size % sizeof(int64_t)) {
+			fprintf(stderr, "%s: broken binary list.\n", fname);
+			fclose(fp);
+			return -1;
+		}
+		snap_list = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				fileno(fp), 0);
+		fclose(fp);
+		if (snap_list == MAP_FAILED) {
+			snap_list = NULL;
+			perror(fname);
+			return -1;
+		}
+		snap_mapped = st.st_size;
+		snap_num = st.st_size / sizeof(int64_t);
+		return snap_sort();
+	}
+
+	rewind(fp);
+	while (fgets(buf, sizeof(buf), fp)) {
+		if ((s = strtok(buf, " \t\r\n")) == NULL) {
+			continue;
+		}
+		if ((ms = arg_offset(s)) == -1) {
+			sec = strtod(s, &endp);
+			if ((endp == s) || *endp) {
+				continue;	/* comments or headers */
+			}
+			ms = (time_t)(sec * 1000 + ((sec < 0) ? -0.5 : 0.5));
+		}
+		if (snap_num >= max) {
+			max = max ? max * 2 : 4096;
+			if ((p = realloc(snap_list, max * sizeof(int64_t))) == NULL) {
+				fclose(fp);
+				return -1;
+			}
+			snap_list = p;
+		}
+		snap_list[snap_num++] = ms;
+	}
+	fclose(fp);
+	return snap_sort();
+}
+
+/* snap the time to the nearest keyframe within the tolerance. The search
+ * gallops from the last found position because the cues are mostly in
+ * order, so it costs O(1) for the neighbouring cues */
+static time_t snap_time(time_t ms)
+{
+	long	lo, hi, mid, step, n = (long) snap_num;
+
+	hi = (snap_cursor < n) ? snap_cursor : n - 1;
+	if (snap_list[hi] < ms) {
+		for (lo = hi, step = 1; ((hi = lo + step) < n) && 
+				(snap_list[hi] < ms); lo = hi, step <<= 1);
+		hi = (hi > n) ? n : hi;
+	} else {
+		for (step = 1; ((lo = hi - step) >= 0) && 
+				(snap_list[lo] >= ms); hi = lo, step <<= 1);
+		lo = (lo < -1) ? -1 : lo;
+	}
+	/* the first keyframe no earlier than 'ms' is in (lo, hi] */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (snap_list[mid] < ms) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	snap_cursor = (hi < n) ? hi : n - 1;
+
+	if ((hi < n) && (lo >= 0)) {
+		lo = (ms - snap_list[lo] <= snap_list[hi] - ms) ? lo : hi;
+	} else {
+		lo = (hi < n) ? hi : lo;
+	}
+	if ((snap_list[lo] - ms <= tm_snaptol) && (ms - snap_list[lo] <= tm_snaptol)) {
+		return snap_list[lo];
+	}
+	return ms;
+}
+
+static int chop_filter(char *s, struct RtState *rs)
+{
+	if ((tm_chop[0] < 0) && (tm_chop[1] < 0)) {
+		return 0;	/* disabled */
+	}
+
+	switch (rs->magic) {
+	case 0:			/* subrip */
+		if (is_number(s)) {
+			rs->subidx++;
+		}
+		//printf("SRT %d\n", rs->subidx);
+		if ((tm_chop[0] > 0) && (rs->subidx < tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((tm_chop[1] > 0) && (rs->subidx > tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	case 1:			/* ASS/SSA */
+		if (strncmp(s, "Dialogue:", 9)) {
+			break;;
+		}
+		rs->subidx++;
+		//printf("ASS %d\n", rs->subidx);
+		if ((tm_chop[0] > 0) && (rs->subidx < tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((tm_chop[1] > 0) && (rs->subidx > tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	default:
+		if (rs->magic > 0) {
+			break;	/* something wrong */
+		}
+		if (is_number(s)) {
+			rs->magic = 0;
+			rs->subidx++;
+		} else if (strtoms(s, NULL, NULL) != -1) {       /* SRT timestamp */
+			rs->magic = 0;
+			rs->subidx++;
+		} else if (!strncmp(s, "[Events]", 8)) {
+			rs->magic = 1;
+			break;
+		} else if (!strncmp(s, "[Script Info]", 13)) {
+			rs->magic = 1;
+			break;
+		} else if (!strncmp(s, "Dialogue:", 9)) {
+			rs->magic = 1;
+			rs->subidx++;
+		} else {
+			break;
+		}
+		if ((tm_chop[0] > 0) && (rs->subidx < tm_chop[0])) {
+			break;	/* no chop */
+		}
+		if ((tm_chop[1] > 0) && (rs->subidx > tm_chop[1])) {
+			break;	/* no chop */
+		}
+		return 1;
+	}
+	return 0;	/* no skip */
+}
+
+/* collect a cue after its time stamps were tweaked. 's' points to the 
+ * rest of the time stamp line. For ASS/SSA, the 'layer' points to the 
+ * Layer field after "Dialogue:" and 's' is like ",Style,...,Effect,Text" */
+static int cue_collect(time_t tm_in, time_t tm_out, char *layer, char *s)
+{
+	struct	SubCue	*cue;
+	int	i, n;
+
+	if (cue_num >= cue_max) {
+		n = cue_max ? cue_max * 2 : 256;
+		if ((cue = realloc(cue_list, n * sizeof(struct SubCue))) == NULL) {
+			return -1;
+		}
+		cue_list = cue;
+		cue_max  = n;
+	}
+	cue = &cue_list[cue_num++];
+	memset(cue, 0, sizeof(struct SubCue));
+	cue->tm_in  = tm_in;
+	cue->tm_out = tm_out;
+	cue_pending = 0;
+	if (layer == NULL) {	/* SRT: text lines are coming */
+		cue_pending = 1;
+		return cue_num;
+	}
+
+	cue->layer = strndup(layer, strcspn(layer, ","));
+	/* the rest of 6 fields before the text of the dialogue */
+	for (i = n = 0; s[i] && (n < 7); i++) {
+		if (s[i] == ',') {
+			n++;
+		}
+	}
+	cue->extra = strndup(s, i);
+	for (s += i, n = strlen(s); (n > 0) && ((s[n-1] == '\n') || 
+				(s[n-1] == '\r')); n--);
+	cue->text = strndup(s, n);
+	return cue_num;
+}
+
+/* collect the SRT text lines, or the ASS/SSA header before any cue */
+static int cue_text(char *s)
+{
+	struct	SubCue	*cue;
+	char	*p;
+	int	n, k;
+
+	if (!cue_pending) {
+		if (cue_num == 0) {	/* the header */
+			n = strlen(s);
+			if ((p = realloc(cue_header, cue_hdlen + n + 1)) == NULL) {
+				return -1;
+			}
+			cue_header = p;
+			strcpy(cue_header + cue_hdlen, s);
+			cue_hdlen += n;
+		}
+		return 0;
+	}
+
+	while ((*s > 0) && (*s <= 0x20)) s++;
+	if (*s == 0) {		/* blank line ends the SRT text */
+		cue_pending = 0;
+		return 0;
+	}
+	for (n = strlen(s); (n > 0) && ((s[n-1] == '\n') || 
+				(s[n-1] == '\r')); n--);
+
+	cue = &cue_list[cue_num-1];
+	k = cue->text ? strlen(cue->text) : 0;
+	if ((p = realloc(cue->text, k + n + 2)) == NULL) {
+		return -1;
+	}
+	cue->text = p;
+	if (k) {
+		p[k++] = '\n';
+	}
+	memcpy(p + k, s, n);
+	p[k+n] = 0;
+	return k + n;
+}
+
+static int cue_format(char *fname)
+{
+	char	*p;
+
+	if ((p = strrchr(fname, '.')) != NULL) {
+		fname = p + 1;
+	}
+	if (!strcasecmp(fname, "srt")) {
+		return 0;
+	}
+	if (!strcasecmp(fname, "ass") || !strcasecmp(fname, "ssa")) {
+		return 1;
+	}
+	if (!strcasecmp(fname, "vtt")) {
+		return 5;
+	}
+	return -1;
+}
+
+/* SRT and WebVTT: ASS/SSA text need to drop the {} override codes 
+ * and convert the \N line breaks. WebVTT escapes '&' and '<' in the plain
+ * text, though the tags and the entities of SRT are valid in WebVTT */
+static void cue_put_text(FILE *fout, struct SubCue *cue, int fmt)
+{
+	char	*s, *p;
+
+	if ((cue->extra == NULL) && (fmt != 5)) {	/* from SRT */
+		fputs(cue->text ? cue->text : "", fout);
+		return;
+	}
+	if (cue->extra == NULL) {
+		for (s = cue->text; s && *s; s++) {
+			/* a bare '&' is not an entity like &amp; or &#38; */
+			for (p = s + 1; (*s == '&') && (isalnum(*p) || 
+						((*p == '#') && (p == s + 1))); p++);
+			if ((*s == '&') && ((*p != ';') || (p == s + 1))) {
+				fputs("&amp;", fout);
+			} else {
+				fputc(*s, fout);
+			}
+		}
+		return;
+	}
+	for (s = cue->text; *s; s++) {
+		if (*s == '{') {
+			while (*s && (*s != '}')) s++;
+			if (*s == 0) {
+				break;
+			}
+		} else if ((*s == '\\') && ((s[1] == 'N') || (s[1] == 'n'))) {
+			fputc('\n', fout);
+			s++;
+		} else if ((*s == '\\') && (s[1] == 'h')) {
+			fputc(' ', fout);
+			s++;
+		} else if ((fmt == 5) && (*s == '&')) {
+			fputs("&amp;", fout);
+		} else if ((fmt == 5) && (*s == '<')) {
+			fputs("&lt;", fout);
+		} else {
+			fputc(*s, fout);
+		}
+	}
+}
+
+/* ASS/SSA: SRT text need to drop the <> HTML tags and join the lines */
+static void cue_put_dialogue(FILE *fout, struct SubCue *cue)
+{
+	char	*s;
+
+	fprintf(fout, "Dialogue:%s,", cue->layer ? cue->layer : " 0");
+	fputs(mstostr(cue->tm_in, 1), fout);
+	fputc(',', fout);
+	fputs(mstostr(cue->tm_out, 1), fout);
+	if (cue->extra) {
+		fputs(cue->extra, fout);
+		fputs(cue->text, fout);
+		fputc('\n', fout);
+		return;
+	}
+	fputs(",Default,,0,0,0,,", fout);
+	for (s = cue->text; s && *s; s++) {
+		if (*s == '<') {
+			while (*s && (*s != '>')) s++;
+			if (*s == 0) {
+				break;
+			}
+		} else if (*s == '\n') {
+			fputs("\\N", fout);
+		} else {
+			fputc(*s, fout);
+		}
+	}
+	fputc('\n', fout);
+}
+
+static int cue_write(FILE *fout, int fmt)
+{
+	int	i, sn;
+
+	if (fmt == 1) {
+		if (cue_header && cue_num && cue_list[0].extra) {
+			fputs(cue_header, fout);
+		} else {
+			fputs(cue_ass_header, fout);
+		}
+		for (i = 0; i < cue_num; i++) {
+			cue_put_dialogue(fout, &cue_list[i]);
+		}
+		return i;
+	}
+
+	if (fmt == 5) {
+		fputs("WEBVTT\n\n", fout);
+	}
+	sn = (tm_srtsn > 0) ? tm_srtsn : 1;
+	for (i = 0; i < cue_num; i++) {
+		if (fmt == 0) {
+			fprintf(fout, "%d\n", sn++);
+		}
+		fputs(mstostr(cue_list[i].tm_in, fmt), fout);
+		fputs(" --> ", fout);
+		fputs(mstostr(cue_list[i].tm_out, fmt), fout);
+		fputc('\n', fout);
+		cue_put_text(fout, &cue_list[i], fmt);
+		fputs("\n\n", fout);
+	}
+	return i;
+}
+
+/* export the collected cues to every requested format. The export can be 
+ * a file name, or a format only so the file name comes from the input */
+static int cue_export(char *iname)
+{
+	FILE	*fout;
+	char	*oname, *p;
+	int	i, fmt;
+
+	for (i = 0; i < tm_exnum; i++) {
+		if ((fmt = cue_format(tm_export[i])) < 0) {
+			fprintf(stderr, "%s: unknown format.\n", tm_export[i]);
+			continue;
+		}
+		if (strchr(tm_export[i], '.')) {
+			oname = strdup(tm_export[i]);
+		} else if (iname == NULL) {
+			fprintf(stderr, "%s: no file name to export.\n", 
+					tm_export[i]);
+			continue;
+		} else {
+			oname = malloc(strlen(iname) + strlen(tm_export[i]) + 2);
+			if (oname) {
+				strcpy(oname, iname);
+				p = strrchr(oname, '.');
+				if (p && !strchr(p, '/')) {
+					*p = 0;
+				}
+				strcat(oname, ".");
+				strcat(oname, tm_export[i]);
+			}
+		}
+		if (oname == NULL) {
+			continue;
+		}
+		if (iname && !strcmp(oname, iname)) {
+			fprintf(stderr, "%s: skip exporting to the input file.\n",
+					oname);
+		} else if ((fout = fopen(oname, "w")) == NULL) {
+			perror(oname);
+		} else {
+			cue_write(fout, fmt);
+			fclose(fout);
+		}
+		free(oname);
+	}
+	cue_free();
+	return i;
+}
+
+static void cue_free(void)
+{
+	int	i;
+
+	for (i = 0; i < cue_num; i++) {
+		free(cue_list[i].layer);
+		free(cue_list[i].extra);
+		free(cue_list[i].text);
+	}
+	cue_num = cue_pending = 0;
+	if (cue_header) {
+		free(cue_header);
+		cue_header = NULL;
+	}
+	cue_hdlen = 0;
+}
+
+/* sort the cues by the start time, then the order in the file */
+static int index_compare(const void *a, const void *b)
+{
+	struct	SubCue	*x = &cue_list[*(const uint32_t *) a];
+	struct	SubCue	*y = &cue_list[*(const uint32_t *) b];
+
+	if (x->tm_in != y->tm_in) {
+		return (x->tm_in < y->tm_in) ? -1 : 1;
+	}
+	return (x < y) ? -1 : (x > y);
+}
+
+/* the implicit augmented interval tree on the sorted array, as cgranges:
+ * the nodes of level k are at the index of (2^k - 1) + j * 2^(k+1), and 
+ * every node keeps the max end time of its subtree */
+static int index_tree(struct CueIndex *ix)
+{
+	int64_t	i, x, e, last_i = 0, last = 0, n = ix->num;
+	int	k;
+
+	if (n == 0) {
+		return ix->level = -1;
+	}
+	for (i = 0; i < n; i += 2) {	/* the leaves */
+		last_i = i;
+		last = ix->max[i] = ix->end[i];
+	}
+	for (k = 1; (1LL << k) <= n; k++) {
+		x = 1LL << (k - 1);
+		for (i = (x << 1) - 1; i < n; i += x << 2) {
+			e = ix->end[i];
+			e = (ix->max[i-x] > e) ? ix->max[i-x] : e;
+			if (i + x < n) {
+				e = (ix->max[i+x] > e) ? ix->max[i+x] : e;
+			} else {
+				e = (last > e) ? last : e;
+			}
+			ix->max[i] = e;
+		}
+		/* the parent of the last node, which may be out of range */
+		last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+		if ((last_i < n) && (ix->max[last_i] > last)) {
+			last = ix->max[last_i];
+		}
+	}
+	return ix->level = k - 1;
+}
+
+/* set the arrays in the memory of the sidecar layout */
+static void index_layout(struct CueIndex *ix, char *base)
+{
+	ix->start = (int64_t *) (base + sizeof(struct IxHeader));
+	ix->end   = ix->start + ix->num;
+	ix->max   = ix->end + ix->num;
+	ix->sn    = (uint32_t *) (ix->max + ix->num);
+	ix->text  = ix->sn + ix->num;
+	ix->blob  = (char *) (ix->text + ix->num);
+}
+
+/* build the index from the collected cues. The text of cues are kept
+ * in SRT form in the blob */
+static int index_build(struct CueIndex *ix)
+{
+	struct	IxHeader	*hdr;
+	FILE	*fp;
+	uint32_t	*order, i;
+	char	*blob = NULL;
+	size_t	blen = 0, n;
+
+	memset(ix, 0, sizeof(struct CueIndex));
+	if ((order = calloc(cue_num + 1, sizeof(uint32_t))) == NULL) {
+		return -1;
+	}
+	if ((fp = open_memstream(&blob, &blen)) == NULL) {
+		free(order);
+		return -1;
+	}
+	for (i = 0; i < (uint32_t) cue_num; i++) {
+		order[i] = (uint32_t) ftell(fp);
+		cue_put_text(fp, &cue_list[i], 0);
+		fputc(0, fp);
+	}
+	fclose(fp);
+
+	ix->num = cue_num;
+	n = sizeof(struct IxHeader) + ix->num * (sizeof(int64_t) * 3 + 
+			sizeof(uint32_t) * 2);
+	if ((ix->base = malloc(n + blen)) == NULL) {
+		free(blob);
+		free(order);
+		return -1;
+	}
+	ix->size = n + blen;
+	index_layout(ix, ix->base);
+	memcpy(ix->blob, blob, blen);
+	memcpy(ix->text, order, ix->num * sizeof(uint32_t));
+	free(blob);
+
+	for (i = 0; i < ix->num; i++) {
+		order[i] = i;
+	}
+	qsort(order, ix->num, sizeof(uint32_t), index_compare);
+	for (i = 0; i < ix->num; i++) {
+		ix->start[i] = cue_list[order[i]].tm_in;
+		ix->end[i]   = cue_list[order[i]].tm_out;
+		ix->sn[i]    = order[i] + 1;
+	}
+	/* the text offsets were in the order of file */
+	for (i = 0; i < ix->num; i++) {
+		ix->max[i] = ix->text[order[i]];
+	}
+	for (i = 0; i < ix->num; i++) {
+		ix->text[i] = (uint32_t) ix->max[i];
+	}
+	free(order);
+	index_tree(ix);
+
+	hdr = (struct IxHeader *) ix->base;
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->num   = ix->num;
+	hdr->level = ix->level;
+	hdr->blob  = blen;
+	return 0;
+}
+
+/* map the sidecar file. Returns 1 if the file is not an index */
+static int index_load(char *fname, struct CueIndex *ix)
+{
+	struct	IxHeader	*hdr;
+	struct	stat	st;
+	size_t	n;
+	uint32_t	i;
+	int	fd, k;
+
+	memset(ix, 0, sizeof(struct CueIndex));
+	if ((fd = open(fname, O_RDONLY)) < 0) {
+		perror(fname);
+		return -1;
+	}
+	if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(struct IxHeader))) {
+		close(fd);
+		return 1;
+	}
+	ix->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ix->base == MAP_FAILED) {
+		ix->base = NULL;
+		return 1;
+	}
+	ix->size = ix->mapped = st.st_size;
+	hdr = (struct IxHeader *) ix->base;
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic))) {
+		index_free(ix);
+		return 1;
+	}
+	ix->num   = hdr->num;
+	ix->level = hdr->level;
+	n = sizeof(struct IxHeader) + ix->num * (sizeof(int64_t) * 3 + 
+			sizeof(uint32_t) * 2);
+	if ((n > ix->size) || (hdr->blob != ix->size - n)) {
+		fprintf(stderr, "%s: broken index.\n", fname);
+		index_free(ix);
+		return -1;
+	}
+	index_layout(ix, ix->base);
+
+	/* the level drives the query stack and the text offsets are used 
+	 * as they are, so never trust them */
+	for (k = (ix->num) ? 0 : -1; (k >= 0) && ((2LL << k) <= ix->num); k++);
+	for (i = 0; (i < ix->num) && (ix->text[i] < hdr->blob); i++);
+	if ((ix->level != k) || (i < ix->num) || 
+			(hdr->blob && ix->blob[hdr->blob - 1])) {
+		fprintf(stderr, "%s: broken index.\n", fname);
+		index_free(ix);
+		return -1;
+	}
+	return 0;
+}
+
+static int index_save(char *fname, struct CueIndex *ix)
+{
+	FILE	*fp;
+
+	if ((fp = fopen(fname, "w")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	if ((fwrite(ix->base, 1, ix->size, fp) != ix->size) | fclose(fp)) {
+		perror(fname);
+		return -1;
 	}
-
-	in_bytes_left  = i;
-	out_bytes_left = len;
-	in_buf = (char*)rbuf;
-	iconv(utf_iconv, &in_buf, &in_bytes_left, &buf, &out_bytes_left);
-	len -= (int)out_bytes_left;
-	*buf = 0;
-	return len;
+	return 0;
 }
 
-static int utf_lr(char *s)
+static void index_free(struct CueIndex *ix)
 {
-	if ((utf_index < 0) || (bom_codepage[utf_index].width == 1)) {
-		return (*s == 0xa);
-	}
-	if (bom_codepage[utf_index].width == 2) {
-		if (bom_codepage[utf_index].endian == 0) {	/* LE */
-			return (!memcmp(s, "\xa\0", 2));
-		} else {
-			return (!memcmp(s, "\0\xa", 2));
-		}
+	if (ix->mapped) {
+		munmap(ix->base, ix->mapped);
+	} else {
+		free(ix->base);
 	}
-	if (bom_codepage[utf_index].endian == 0) {	/* LE */
-		return (!memcmp(s, "\xa\0\0\0", 4));
+	ix->base = NULL;
+}
+
+/* the time in the index which is the last one tweaked to no later than 't'.
+ * tweaktime() is monotone without the span so the query can be mapped back */
+static time_t index_inverse(time_t t)
+{
+	time_t	ms = t;
+
+	if (tm_scale != 0.0) {
+		ms = (time_t)(t / tm_scale);
 	}
-	return (!memcmp(s, "\0\0\0\xa", 4));
+	ms -= tm_offset;
+	while (tweaktime(ms + 1) <= t) ms++;
+	while (tweaktime(ms) > t) ms--;
+	return ms;
 }
 
-static int utf_bom_detect(FILE *fin)
+static void index_put(struct CueIndex *ix, int64_t i, FILE *fout)
 {
-	char	buf[8];
-	int	i, k, n;
+	time_t	tm_in = ix->tweak ? tweaktime(ix->start[i]) : ix->start[i];
 
-	for (i = 0; i < 4; i++) {
-		buf[i] = (char) fgetc(fin);
-		n = i + 1;
-		for (k = 0; k < BOMLEN; k++) {
-			if (!memcmp(bom_codepage[k].magic, buf, n)) {
-				if (bom_codepage[k].magic_len > n) {
-					break;	/* partial matching */
-				}
-				return k;	/* the matching codepage */
-			}
-		}
-		if (k == BOMLEN) {	/* no match found */
-			memcpy(&bom_overflow[1], buf, n);
-			bom_overflow[0] = n;
-			break;
-		}
-        }
-        return -1;
+	fprintf(fout, "%u\n", ix->sn[i]);
+	fputs(mstostr(tm_in, 0), fout);
+	fputs(" --> ", fout);
+	fputs(mstostr(ix->tweak ? tweakend(ix->end[i], ix->start[i], tm_in) :
+				ix->end[i], 0), fout);
+	fputc('\n', fout);
+	fputs(ix->blob + ix->text[i], fout);
+	fputs("\n\n", fout);
 }
 
-static int utf_bom_user_defined(char *s)
+/* output the cues which start no later than 't2' and end after 't1',
+ * in the order of the start time. Returns the number of cues */
+static int index_query(struct CueIndex *ix, time_t t1, time_t t2, FILE *fout)
 {
-	int	i;
+	struct	{ int64_t x; int k, w; } stack[64], z;
+	int64_t	i, i1, y, n = ix->num;
+	int	t = 0, found = 0;
 
-	for (i = 0; i < BOMLEN; i++) {
-		if (!strcasecmp(bom_codepage[i].iconv_name, s)) {
-			return i;
+	if (ix->level < 0) {
+		return 0;
+	}
+	if (ix->tweak && ((tm_range[0] > -1) || snap_num)) {
+		/* tweaked by the span is not monotone, and the snapped end
+		 * depends on the start: scan them all */
+		for (i = 0; i < n; i++) {
+			if (((y = tweaktime(ix->start[i])) <= t2) && 
+					(tweakend(ix->end[i], ix->start[i], y) > t1)) {
+				index_put(ix, i, fout);
+				found++;
+			}
 		}
+		return found;
 	}
-	strncpy(bom_codepage[i].iconv_name, s, sizeof(bom_user_defined));
-	if (strstr(s, "16")) {
-		bom_codepage[i].width = 2;
-	} else if (strstr(s, "32")) {
-		bom_codepage[i].width = 4;
+	if (ix->tweak) {
+		t1 = index_inverse(t1);
+		t2 = index_inverse(t2);
 	}
-	if (strstr(s, "BE") || strstr(s, "be")) {
-		bom_codepage[i].endian = 1;
+
+	stack[t].x = (1LL << ix->level) - 1;	/* the root */
+	stack[t].k = ix->level;
+	stack[t++].w = 0;
+	while (t) {
+		z = stack[--t];
+		if (z.k <= 3) {		/* small subtree: scan it */
+			i = z.x >> z.k << z.k;
+			i1 = i + (1LL << (z.k + 1)) - 1;
+			i1 = (i1 > n) ? n : i1;
+			for ( ; (i < i1) && (ix->start[i] <= t2); i++) {
+				if (ix->end[i] > t1) {
+					index_put(ix, i, fout);
+					found++;
+				}
+			}
+		} else if (z.w == 0) {	/* the left child first */
+			y = z.x - (1LL << (z.k - 1));
+			stack[t].x = z.x;
+			stack[t].k = z.k;
+			stack[t++].w = 1;
+			if ((y >= n) || (ix->max[y] > t1)) {
+				stack[t].x = y;
+				stack[t].k = z.k - 1;
+				stack[t++].w = 0;
+			}
+		} else if ((z.x < n) && (ix->start[z.x] <= t2)) {
+			if (ix->end[z.x] > t1) {
+				index_put(ix, z.x, fout);
+				found++;
+			}
+			stack[t].x = z.x + (1LL << (z.k - 1));
+			stack[t].k = z.k - 1;
+			stack[t++].w = 0;
+		}
 	}
-	return i;
+	return found;
 }
 
-static time_t tweaktime(time_t ms)
+/* the query of "T" is the cues active at T, and "T1 T2" is the cues
+ * showing in any time of [T1,T2] */
+static int index_ask(struct CueIndex *ix, char *t1, char *t2, FILE *fout)
 {
-	if (tm_range[0] > -1) {	/* check the time stamp range */
-		if (ms < tm_range[0]) {
-			return ms;
-		}
-		if ((tm_range[1] > -1) && (ms > tm_range[1])) {
-			return ms;
-		}
+	time_t	ms1, ms2;
+
+	if ((ms1 = arg_offset(t1)) == -1) {
+		fprintf(stderr, "%s: invalid time.\n", t1);
+		return -1;
 	}
-	if (tm_offset) {
-		ms += tm_offset;
+	if (t2 == NULL) {
+		return index_query(ix, ms1, ms1, fout);
 	}
-	if (tm_scale != 0.0) {
-		ms *= tm_scale;
+	if ((ms2 = arg_offset(t2)) == -1) {
+		fprintf(stderr, "%s: invalid time.\n", t2);
+		return -1;
 	}
-	return ms;
+	return index_query(ix, ms1 - 1, ms2, fout);
 }
 
-static int chop_filter(char *s, int *magic)
+/* build the index from the subtitle file, or map the index sidecar,
+ * then save the index, or answer the queries. The transform is applied 
+ * when parsing the subtitles, or at query time for the sidecar */
+static int index_main(char *fname, FILE *fout)
 {
-	static	int	subidx;
-
-	if ((tm_chop[0] < 0) && (tm_chop[1] < 0)) {
-		return 0;	/* disabled */
-	}
+	struct	CueIndex	ix;
+	FILE	*fin, *fnull;
+	char	buf[256], *t1, *t2;
+	int	rc;
 
-	switch (*magic) {
-	case 0:			/* subrip */
-		if (is_number(s)) {
-			subidx++;
-		}
-		//printf("SRT %d\n", subidx);
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
-		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
-		}
-		return 1;
-	case 1:			/* ASS/SSA */
-		if (strncmp(s, "Dialogue:", 9)) {
-			break;;
-		}
-		subidx++;
-		//printf("ASS %d\n", subidx);
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
-		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
+	if ((fname == NULL) || ((rc = index_load(fname, &ix)) > 0)) {
+		if (fname == NULL) {
+			fin = zio_input(stdin, NULL);
+		} else if ((fin = fopen(fname, "r")) == NULL) {
+			perror(fname);
+			return -1;
+		} else {
+			fin = zio_input(fin, NULL);
 		}
-		return 1;
-	default:
-		if (*magic > 0) {
-			break;	/* something wrong */
+		if (fin == NULL) {
+			return -1;
 		}
-		if (is_number(s)) {
-			*magic = 0;
-			subidx++;
-		} else if (strtoms(s, NULL, NULL) != -1) {       /* SRT timestamp */
-			*magic = 0;
-			subidx++;
-		} else if (!strncmp(s, "[Events]", 8)) {
-			*magic = 1;
-			break;
-		} else if (!strncmp(s, "[Script Info]", 13)) {
-			*magic = 1;
-			break;
-		} else if (!strncmp(s, "Dialogue:", 9)) {
-			*magic = 1;
-			subidx++;
-		} else {
-			break;
+		if ((fnull = fopen("/dev/null", "w")) == NULL) {
+			fclose(fin);
+			return -1;
 		}
-		if ((tm_chop[0] > 0) && (subidx < tm_chop[0])) {
-			break;	/* no chop */
+		cue_enable = 1;
+		retiming(fin, fnull);
+		fclose(fnull);
+		if (fin != stdin) {
+			fclose(fin);
 		}
-		if ((tm_chop[1] > 0) && (subidx > tm_chop[1])) {
-			break;	/* no chop */
+		rc = index_build(&ix);
+		cue_free();
+	} else {
+		ix.tweak = (tm_offset != 0) || (tm_scale != 0.0) || snap_num;
+	}
+	if (rc < 0) {
+		return -1;
+	}
+
+	if (tm_index && index_save(tm_index, &ix) < 0) {
+		rc = -1;
+	}
+	if (tm_query[0] && strcmp(tm_query[0], "-")) {
+		index_ask(&ix, tm_query[0], tm_query[1], fout);
+	} else if (tm_query[0]) {	/* batch queries from stdin */
+		while (fgets(buf, sizeof(buf), stdin)) {
+			if ((t1 = strtok(buf, " \t\r\n")) == NULL) {
+				continue;
+			}
+			t2 = strtok(NULL, " \t\r\n");
+			fprintf(fout, "## %s%s%s\n", t1, t2 ? " " : "", t2 ? t2 : "");
+			index_ask(&ix, t1, t2, fout);
+			fflush(fout);
 		}
-		return 1;
 	}
-	return 0;	/* no skip */
+	index_free(&ix);
+	return rc;
 }
 
 static time_t strtoms(char *s, int *len, int *style)
@@ -639,7 +3615,7 @@ static time_t strtoms(char *s, int *len, int *style)
 		"%d . %d . %d . %d%n",
 		"%d - %d - %d - %d%n",
 		NULL };
-	int	i, hour, min, sec, msec, num, type;
+	int	i, n, hour, min, sec, msec, num, type;
 
 	if (len) {
 		*len = 0;
@@ -656,7 +3632,19 @@ static time_t strtoms(char *s, int *len, int *style)
 	}
 	//printf("%s:  %d-%d-%d-%d (%d)\n", s, hour, min, sec, msec, num);
 	if (!pattern[i]) {
-		return -1;	/* parameters not match */
+		/* WebVTT may be in short form MM:SS.mmm if the hour is zero */
+		for (n = 0; isspace(s[n]); n++);
+		if (!isdigit(s[n]) || !isdigit(s[n+1]) || (s[n+2] != ':') ||
+				!isdigit(s[n+3]) || !isdigit(s[n+4]) || 
+				(s[n+5] != '.') || !isdigit(s[n+6]) || 
+				!isdigit(s[n+7]) || !isdigit(s[n+8]) || 
+				isdigit(s[n+9])) {
+			return -1;	/* parameters not match */
+		}
+		hour = 0;
+		sscanf(s + n, "%d:%d.%d", &min, &sec, &msec);
+		num = n + 9;
+		i = 6;
 	}
 	
 	if ((min < 0) || (min > 59)) {
@@ -666,12 +3654,17 @@ static time_t strtoms(char *s, int *len, int *style)
 		return -1;
 	}
 
-	/* special case: ASS/SSA uses centiseconds */
+	/* special case: ASS/SSA uses centiseconds but WebVTT uses 
+	 * milliseconds by 3 digits */
 	if (i == 1) {
-		if ((msec < 0) || (msec > 99)) {
+		for (n = 0; (num > n) && isdigit(s[num-n-1]); n++);
+		if (n == 3) {
+			i = 5;	/* WebVTT */
+		} else if ((msec < 0) || (msec > 99)) {
 			return -1;
+		} else {
+			msec *= 10;
 		}
-		msec *= 10;
 	} else {
 		if ((msec < 0) || (msec > 999)) {
 			return -1;
@@ -695,7 +3688,7 @@ static time_t strtoms(char *s, int *len, int *style)
 
 static char *mstostr(time_t ms, int style)
 {
-	static	char	stmp[32];
+	static	__thread	char	stmp[32];
 	char	*buf = stmp;
 	int	hh, mm, ss;
 
@@ -724,6 +3717,15 @@ static char *mstostr(time_t ms, int style)
 	case 4:
 		sprintf(buf, "%02d-%02d-%02d-%03lld", hh, mm, ss, ms);
 		break;
+	case 6:		/* WebVTT in short form */
+		if (hh == 0) {
+			sprintf(buf, "%02d:%02d.%03lld", mm, ss, (long long) ms);
+			break;
+		}
+		/* fall through: the short form has no hour */
+	case 5:		/* WebVTT */
+		sprintf(buf, "%02d:%02d:%02d.%03lld", hh, mm, ss, (long long) ms);
+		break;
 	case 0:		/* SRT */
 	default:
 		sprintf(buf, "%02d:%02d:%02d,%03lld", hh, mm, ss, ms);
@@ -825,6 +3827,163 @@ static int is_number(char *s)
 	return (*s > 0x20) ? 0 : 1;
 }
 
+/* the residual of an anchor by the model: expected = a * actual + c */
+#define FIT_RES(p,a,c)	((p)->y - (a) * (p)->x - (c))
+
+/* the Huber weights for the residuals within the tolerance, down weighted
+ * to three times of it, and the farther ones carry no weight */
+static double fit_weight(double r, double tol)
+{
+	r = fabs(r);
+	if (r <= tol) {
+		return 1.0;
+	}
+	return (r <= tol * 3) ? tol / r : 0.0;
+}
+
+/* fit the offset and the scale from the anchors of (expected, actual) time 
+ * stamps. RANSAC picks the model of two anchors with the most inliers, 
+ * then the Huber IRLS refines it. The fitted transform is applied as the 
+ * offset and the scale of the command line */
+static int fit_anchors(char *fname, time_t tol)
+{
+	struct	FitAnchor	*anc = NULL, *p;
+	FILE	*fp;
+	char	buf[256], *s1, *s2;
+	double	a, c, ba, bc, w, sw, sx, sy, sxx, sxy, mx, my, rms, rmax;
+	int	i, j, k, n = 0, max = 0, line = 0, best, inl, iter, need;
+	unsigned	seed = 2463534242U;
+	time_t	t1, t2;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), fp)) {
+		line++;
+		if (((s1 = strtok(buf, " \t\r\n")) == NULL) || (*s1 == '#')) {
+			continue;
+		}
+		s2 = strtok(NULL, " \t\r\n");
+		if (!s2 || ((t1 = arg_offset(s1)) == -1) || 
+				((t2 = arg_offset(s2)) == -1)) {
+			fprintf(stderr, "%s:%d: invalid anchor.\n", fname, line);
+			continue;
+		}
+		if (n >= max) {
+			max = max ? max * 2 : 256;
+			if ((p = realloc(anc, max * sizeof(struct FitAnchor))) == NULL) {
+				break;
+			}
+			anc = p;
+		}
+		anc[n].y = (double) t1;
+		anc[n].x = (double) t2;
+		anc[n].line = line;
+		n++;
+	}
+	fclose(fp);
+	if (n == 0) {
+		fprintf(stderr, "%s: no anchors.\n", fname);
+		free(anc);
+		return -1;
+	}
+
+	/* start from the shifting of the first anchor */
+	ba = 1.0;
+	bc = anc[0].y - anc[0].x;
+	for (k = best = 0; k < n; k++) {
+		best += (fabs(FIT_RES(&anc[k], ba, bc)) <= tol);
+	}
+	/* RANSAC: stop when the best model was hit by 99.9% probability,
+	 * which needs about ln(1000)/w^2 trials of the inlier ratio w */
+	for (iter = 0, need = 500; (n > 1) && (iter < need); iter++) {
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		i = seed % n;
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		j = seed % n;
+		if (anc[i].x == anc[j].x) {
+			continue;
+		}
+		a = (anc[j].y - anc[i].y) / (anc[j].x - anc[i].x);
+		if (a <= 0) {
+			continue;	/* the time never goes backward */
+		}
+		c = anc[i].y - a * anc[i].x;
+		for (k = inl = 0; k < n; k++) {
+			inl += (fabs(FIT_RES(&anc[k], a, c)) <= tol);
+		}
+		if (inl > best) {
+			best = inl;
+			ba = a;
+			bc = c;
+			w = (double) inl / n;
+			need = (int)(7.0 / (w * w)) + 1;
+			need = (need > 500) ? 500 : need;
+		}
+	}
+
+	/* Huber IRLS by the weighted least squares around the means */
+	for (iter = 0; iter < 30; iter++) {
+		sw = sx = sy = 0;
+		for (k = 0, p = anc; k < n; k++, p++) {
+			p->w = fit_weight(FIT_RES(p, ba, bc), tol);
+			sw += p->w;
+			sx += p->w * p->x;
+			sy += p->w * p->y;
+		}
+		if (sw == 0) {
+			break;
+		}
+		mx = sx / sw;
+		my = sy / sw;
+		sxx = sxy = 0;
+		for (k = 0, p = anc; k < n; k++, p++) {
+			sxx += p->w * (p->x - mx) * (p->x - mx);
+			sxy += p->w * (p->x - mx) * (p->y - my);
+		}
+		/* anchors within a second can't tell the scale */
+		a = (sxx / sw < 1e6) ? 1.0 : sxy / sxx;
+		c = my - a * mx;
+		if ((fabs(a - ba) < 1e-12) && (fabs(c - bc) < 1e-3)) {
+			break;
+		}
+		ba = a;
+		bc = c;
+	}
+
+	/* report the fitting and the outliers */
+	rms = rmax = 0;
+	for (k = inl = 0, p = anc; k < n; k++, p++) {
+		w = FIT_RES(p, ba, bc);
+		if (fabs(w) <= tol) {
+			inl++;
+			rms += w * w;
+			rmax = (fabs(w) > rmax) ? fabs(w) : rmax;
+		}
+	}
+	tm_scale  = (ba == 1.0) ? 0.0 : ba;
+	w = bc / ba;
+	tm_offset = (time_t)(w + ((w < 0) ? -0.5 : 0.5));
+	fprintf(stderr, "Fitted %d anchors by %d inliers: "
+			"expected = %.9g * actual %+.1f ms\n", n, inl, ba, bc);
+	fprintf(stderr, "Residuals of inliers: rms %.1f ms, max %.1f ms\n",
+			inl ? sqrt(rms / inl) : 0.0, rmax);
+	for (k = 0, p = anc; k < n; k++, p++) {
+		w = FIT_RES(p, ba, bc);
+		if (fabs(w) > tol) {
+			fprintf(stderr, "Outlier at line %d: %s ", p->line,
+					mstostr((time_t) p->y, 0));
+			fprintf(stderr, "%s (residual %+.0f ms)\n", 
+					mstostr((time_t) p->x, 0), w);
+		}
+	}
+	fprintf(stderr, "Applied as: %c%lld -%.9g\n", (tm_offset < 0) ? '-' : '+',
+			(long long)((tm_offset < 0) ? -tm_offset : tm_offset), ba);
+	free(anc);
+	return inl;
+}
+
 static void utf_dump(void)
 {
 	int	n;
@@ -850,6 +4009,16 @@ static int mocker(FILE *fin, char *argv)
 		} else {
 			printf("BOM %s\n", bom_codepage[n].iconv_name);
 		}
+	} else if (!strcmp(argv,  "--mock-guess")) {
+		n = utf_bom_detect(fin);
+		if (n < 0) {
+			n = utf_guess(fin);
+		}
+		if (n < 0) {
+			printf("Encoding not detected\n");
+		} else {
+			printf("Encoding %s\n", bom_codepage[n].iconv_name);
+		}
 	} else if (!strcmp(argv,  "--mock-encoding")) {
 		utf_dump();
 	} else if (!strcmp(argv,  "--mock-open")) {
@@ -903,6 +4072,8 @@ static int help_tools(int argc, char **argv)
 		printf("Subtitle chopping:   from %d to %d\n", tm_chop[0], tm_chop[1]);
 	} else if (!strcmp(*argv, "--help-example")) {
 		puts(subsync_help_example);
+	} else if (!strcmp(*argv, "--help-bench")) {
+		return bench_main(argc, argv);
 	} else {
 		puts(subsync_help_extra);
 	}
@@ -927,6 +4098,8 @@ static void test_str_to_ms(void)
 		" + 12:34:56,789",
 		" -12:34:56,789",
 		"::::",
+		"12:34:56.789",
+		"01:02.345",
 		NULL
 	};
 
@@ -936,3 +4109,308 @@ static void test_str_to_ms(void)
 	}
 }
 
+
+/* the differential benchmark: every engine retimes every sample in every
+ * encoding in a forked child. The outputs must be identical to the line
+ * engine's, and the throughput, peak RSS and I/O syscalls are reported */
+static int bench_main(int argc, char **argv)
+{
+	char	*engine[] = { "line", "block", "chunk", "pipe" };
+	char	*mode[] = { "-", "-r", "-c", "-r -c" };
+	char	*tmp, dir[256], src[320], enc[320], out[320], *name, *cp;
+	struct	BenchRun	*br, ref;
+	int	i, k, m, n, bad = 0, runs = 0, fall = 0;
+	int	srtsn = tm_srtsn, chop[2] = { tm_chop[0], tm_chop[1] };
+
+	if ((tmp = getenv("TMPDIR")) == NULL) {
+		tmp = "/tmp";
+	}
+	snprintf(dir, sizeof(dir), "%s/subsync-bench-XXXXXX", tmp);
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+	/* shared with the children to bring back the syscall counters */
+	br = mmap(NULL, sizeof(struct BenchRun), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED) {
+		perror("mmap");
+		rmdir(dir);
+		return 1;
+	}
+	snprintf(enc, sizeof(enc), "%s/in", dir);
+	snprintf(out, sizeof(out), "%s/out", dir);
+
+	/* a transform is required otherwise the engines just copy */
+	if ((tm_offset == 0) && (tm_scale == 0)) {
+		tm_offset = 1500;
+		tm_scale = 1.000955;
+	}
+	if (tm_jobs < 2) {
+		tm_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		tm_jobs = (tm_jobs < 2) ? 2 : tm_jobs;
+	}
+	printf("Offset %lld ms, scale %f, %d jobs, best of %d runs\n", 
+			(long long) tm_offset, tm_scale, tm_jobs, BENCH_RUNS);
+	printf("MB/s includes forking the child and opening the files\n");
+	printf("The samples also run with -r 100 and -c %d:%d as-is\n",
+			BENCH_CUES / 4, BENCH_CUES / 2);
+	printf("%-16s %-10s %-5s %-6s %10s %8s %8s %7s %7s  %s\n", "SAMPLE", 
+			"ENCODING", "OPTS", "ENGINE", "BYTES", "MB/s", "RSS(KB)", 
+			"READS", "WRITES", "OUTPUT");
+
+	/* the synthetic samples go first, then the files of the corpus */
+	for (n = -2; n < argc - 1; n++) {
+		if (n < 0) {
+			snprintf(src, sizeof(src), "%s/bench.%s", dir, 
+					(n == -2) ? "srt" : "ass");
+			if (bench_sample(src, n + 2) < 0) {
+				continue;
+			}
+		} else {
+			snprintf(src, sizeof(src), "%s", argv[n+1]);
+		}
+		name = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+
+		for (i = -1; i < (int)BOMLEN; i++) {
+			cp = (i < 0) ? "as-is" : bom_codepage[i].iconv_name;
+			if (bench_encode(src, enc, i) < 0) {
+				printf("%-16.16s %-10.10s skipped: no conversion\n", 
+						name, cp);
+				continue;
+			}
+			/* the serial numbers and the chopping across the chunks
+			 * only for the samples in single byte */
+			for (m = 0; m < ((n < 0) && (i < 0) ? 4 : 1); m++) {
+				tm_srtsn = (m & 1) ? 100 : srtsn;
+				tm_chop[0] = (m & 2) ? BENCH_CUES / 4 : chop[0];
+				tm_chop[1] = (m & 2) ? BENCH_CUES / 2 : chop[1];
+				for (k = RT_LINE; k <= RT_PIPE; k++) {
+					bench_run(enc, out, k, br);
+					runs++;
+					if (k == RT_LINE) {
+						ref = *br;
+					} else if (br->failed || ref.failed || 
+							(br->hash != ref.hash) || 
+							(br->size != ref.size)) {
+						bad++;
+					}
+					/* the numbers are the line engine's */
+					if (!br->failed && (br->engine != k)) {
+						printf("%-16.16s %-10.10s %-5s %-6s "
+							"fallback to %s%s\n", name, cp,
+							mode[m], engine[k],
+							engine[br->engine], 
+							(br->hash == ref.hash) && 
+							(br->size == ref.size) ? 
+							"" : ", DIFF");
+						fall++;
+						continue;
+					}
+					printf("%-16.16s %-10.10s %-5s %-6s %10ld %8.2f "
+							"%8ld %7lld %7lld  ", name, cp, 
+							mode[m], engine[k], br->size, 
+							br->mbps, br->maxrss, 
+							br->syscr, br->syscw);
+					if (br->failed) {
+						printf("FAILED\n");
+					} else if (k == RT_LINE) {
+						printf("%016llx\n", 
+							(unsigned long long) br->hash);
+					} else {
+						printf("%s\n", (br->hash == ref.hash) && 
+							(br->size == ref.size) ? 
+							"same" : "DIFF");
+					}
+					fflush(stdout);
+				}
+			}
+			tm_srtsn = srtsn;
+			tm_chop[0] = chop[0];
+			tm_chop[1] = chop[1];
+		}
+		if (n < 0) {
+			unlink(src);
+		}
+	}
+	unlink(enc);
+	unlink(out);
+	rmdir(dir);
+	munmap(br, sizeof(struct BenchRun));
+	printf("%d runs, %d fallbacks, %d mismatches\n", runs, fall, bad);
+	return bad ? 1 : 0;
+}
+
+/* generate the synthetic sample of SRT in the styles 0,2,3,4,5,6 cycled by
+ * cues, or of ASS in CRLF. Some long lines test the line cutting */
+static int bench_sample(char *fname, int ass)
+{
+	char	*lead[] = { "", "", " ", "\t", "  " };
+	char	*text[] = { "Ça va? — très bien.", "你好，世界！",
+		"Привет, мир!", "<i>Just a line.</i>", "もしもし。" };
+	time_t	ms;
+	FILE	*fp;
+	int	i, k;
+
+	if ((fp = fopen(fname, "w")) == NULL) {
+		perror(fname);
+		return -1;
+	}
+	if (ass) {
+		fputs("[Script Info]\r\nScriptType: v4.00+\r\n\r\n[Events]\r\n"
+			"Format: Layer, Start, End, Style, Name, MarginL, "
+			"MarginR, MarginV, Effect, Text\r\n", fp);
+	}
+	for (i = 0; i < BENCH_CUES; i++) {
+		ms = (time_t)i * 2500 + (i % 7) * 13;
+		if (ass) {
+			fprintf(fp, "Dialogue: %d,%s,", i % 3, mstostr(ms, 1));
+			fprintf(fp, "%s,Default,,0,0,0,,%s\r\n", 
+					mstostr(ms + 1800, 1), text[i % 5]);
+			continue;
+		}
+		k = (i % 6) ? (i % 6) + 1 : 0;	/* styles 0,2,3,4,5,6 */
+		if (k == 6) {
+			ms %= 3600000;	/* the short form is in the first hour */
+		}
+		fprintf(fp, "%d\n%s%s --> ", i + 1, lead[i % 5], 
+				mstostr(ms, k));
+		fprintf(fp, "%s\n%s\n", mstostr(ms + 1800, k), text[i % 5]);
+		if ((i % 997) == 0) {
+			for (k = 0; k < 6000; k++) {
+				fputc('a' + k % 26, fp);
+			}
+			fputc('\n', fp);
+		}
+		fputc('\n', fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* copy the sample as is, or convert it from UTF-8 into the encoding of
+ * the BOM table, with the BOM ahead */
+static int bench_encode(char *src, char *dst, int idx)
+{
+	static	char	ibuf[65536], obuf[65536 * 4];
+	char	*ip, *op;
+	size_t	ilen, olen, n, left = 0;
+	iconv_t	cd = (iconv_t) -1;
+	FILE	*fin, *fout;
+	int	rc = 0;
+
+	if ((idx >= 0) && ((cd = iconv_open(bom_codepage[idx].iconv_name,
+					"UTF-8")) == (iconv_t) -1)) {
+		return -1;
+	}
+	if ((fin = fopen(src, "r")) == NULL) {
+		perror(src);
+		rc = -1;
+	} else if ((fout = fopen(dst, "w")) == NULL) {
+		perror(dst);
+		fclose(fin);
+		rc = -1;
+	} else {
+		if (idx >= 0) {
+			fwrite(bom_codepage[idx].magic, 1, 
+					bom_codepage[idx].magic_len, fout);
+		}
+		/* the incomplete sequence at the end is carried to the next */
+		while (((n = fread(ibuf + left, 1, sizeof(ibuf) - left, fin)) > 0)
+				|| left) {
+			ilen = left + n;
+			if (idx < 0) {
+				fwrite(ibuf, 1, ilen, fout);
+				left = 0;
+				continue;
+			}
+			ip = ibuf;
+			op = obuf;
+			olen = sizeof(obuf);
+			if ((iconv(cd, &ip, &ilen, &op, &olen) == (size_t) -1) &&
+					((errno != EINVAL) || (n == 0))) {
+				rc = -1;
+				break;
+			}
+			fwrite(obuf, 1, op - obuf, fout);
+			memmove(ibuf, ip, ilen);
+			left = ilen;
+		}
+		fclose(fin);
+		if (fclose(fout)) {
+			rc = -1;
+		}
+	}
+	if (cd != (iconv_t) -1) {
+		iconv_close(cd);
+	}
+	return rc;
+}
+
+/* retime the sample by the engine in the children, keeping the best time.
+ * The syscall counters come from the Linux task I/O accounting */
+static int bench_run(char *src, char *dst, int engine, struct BenchRun *br)
+{
+	struct	timespec	t0, t1;
+	struct	rusage	ru;
+	struct	stat	st;
+	double	sec;
+	FILE	*fin, *fout;
+	char	buf[128];
+	pid_t	pid;
+	int	i, status;
+
+	memset(br, 0, sizeof(struct BenchRun));
+	if (stat(src, &st) < 0) {
+		br->failed = 1;
+		return -1;
+	}
+	for (i = 0; i < BENCH_RUNS; i++) {
+		fflush(stdout);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((pid = fork()) == 0) {
+			tm_engine = engine;
+			if (((fin = fopen(src, "r")) == NULL) || 
+					((fout = fopen(dst, "w")) == NULL)) {
+				_exit(1);
+			}
+			if ((fin = zio_input(fin, NULL)) == NULL) {
+				_exit(1);
+			}
+			if (retiming(fin, fout) < 0) {
+				_exit(1);
+			}
+			fclose(fout);
+			br->engine = rt_engine;
+			br->syscr = br->syscw = -1;
+			if ((fin = fopen("/proc/self/io", "r")) != NULL) {
+				while (fgets(buf, sizeof(buf), fin)) {
+					if (!strncmp(buf, "syscr:", 6)) {
+						br->syscr = strtoll(buf + 6, NULL, 10);
+					} else if (!strncmp(buf, "syscw:", 6)) {
+						br->syscw = strtoll(buf + 6, NULL, 10);
+					}
+				}
+			}
+			_exit(0);
+		} else if ((pid < 0) || (wait4(pid, &status, 0, &ru) < 0) || 
+				!WIFEXITED(status) || WEXITSTATUS(status)) {
+			br->failed = 1;
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		sec = (double)st.st_size / 1048576.0 / (sec > 0 ? sec : 1e-9);
+		br->mbps = (sec > br->mbps) ? sec : br->mbps;
+		br->maxrss = (ru.ru_maxrss > br->maxrss) ? ru.ru_maxrss : br->maxrss;
+		if (br->engine != engine) {
+			break;		/* fell back, no need to time it again */
+		}
+	}
+	if ((stat(dst, &st) < 0) || (xxh64_file(dst, &br->hash) < 0)) {
+		br->failed = 1;
+		return -1;
+	}
+	br->size = st.st_size;
+	return 0;
+}